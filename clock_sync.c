@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "clock_sync.h"
+
+void clock_sync_init(struct clock_sync* sync) {
+    sync->sample_count = 0;
+    sync->next_sample = 0;
+}
+
+void clock_sync_add_sample(struct clock_sync* sync, uint32_t sent,
+        uint32_t remote, uint32_t received) {
+    /* Timestamps wrap, so only their differences are meaningful */
+    uint32_t round_trip = received - sent;
+    if (round_trip > CLOCK_SYNC_MAX_ROUND_TRIP_US) {
+        return;
+    }
+
+    sync->samples[sync->next_sample] = (struct clock_sample) {
+        .offset = remote - (sent + round_trip / 2),
+        .round_trip = round_trip
+    };
+    sync->next_sample = (sync->next_sample + 1) % CLOCK_SYNC_SAMPLES;
+    if (sync->sample_count < CLOCK_SYNC_SAMPLES) {
+        sync->sample_count++;
+    }
+}
+
+static const struct clock_sample* best_sample(const struct clock_sync* sync) {
+    const struct clock_sample* best = NULL;
+    for (size_t i = 0; i < sync->sample_count; i++) {
+        if (best == NULL || sync->samples[i].round_trip < best->round_trip) {
+            best = &sync->samples[i];
+        }
+    }
+
+    return best;
+}
+
+int clock_sync_to_local(const struct clock_sync* sync, uint32_t remote,
+        uint32_t* local) {
+    const struct clock_sample* best = best_sample(sync);
+    if (best == NULL) {
+        return -1;
+    }
+
+    *local = remote - best->offset;
+
+    return 0;
+}
+
+uint32_t clock_sync_round_trip(const struct clock_sync* sync) {
+    const struct clock_sample* best = best_sample(sync);
+
+    return best != NULL ? best->round_trip : 0;
+}
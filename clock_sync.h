@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _CLOCK_SYNC_H_
+#define _CLOCK_SYNC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The offset is taken from the ping with the shortest round trip among the
+ * last this many, as the one least delayed by queueing on the way */
+#define CLOCK_SYNC_SAMPLES 8
+
+/* Pings answered later than this are not worth a sample */
+#define CLOCK_SYNC_MAX_ROUND_TRIP_US (1000 * 1000)
+
+struct clock_sample {
+    /* Remote time minus local time */
+    uint32_t offset;
+    uint32_t round_trip;
+};
+
+/*
+ * Estimates the offset between the local clock and the clock of a peer, both
+ * given as protocol timestamps, from pings sent to the peer. The peer's clock
+ * is assumed to be read halfway through the round trip.
+ */
+struct clock_sync {
+    struct clock_sample samples[CLOCK_SYNC_SAMPLES];
+    size_t sample_count;
+    size_t next_sample;
+};
+
+void clock_sync_init(struct clock_sync* sync);
+
+/* Adds a ping sent at local time sent, which the peer answered at its time
+ * remote and which got back at local time received */
+void clock_sync_add_sample(struct clock_sync* sync, uint32_t sent,
+        uint32_t remote, uint32_t received);
+
+/* Translates a time of the peer into local time. Returns 0 on success or -1
+ * if there is no estimate yet.
+ */
+int clock_sync_to_local(const struct clock_sync* sync, uint32_t remote,
+        uint32_t* local);
+
+/* Returns the shortest round trip among the samples in microseconds, or 0 if
+ * there are none */
+uint32_t clock_sync_round_trip(const struct clock_sync* sync);
+
+#endif /* _CLOCK_SYNC_H_ */
@@ -0,0 +1,760 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "connection.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+static int connect_to_server(const char* host, const char* service,
+        int socktype, const struct socket_profile* profile) {
+    struct addrinfo connection_hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = socktype,
+    };
+
+    struct addrinfo* server_addrs;
+    int addr_res = getaddrinfo(host, service, &connection_hints, &server_addrs);
+    if (addr_res != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(addr_res));
+        return -1;
+    }
+
+    int socket_fd = -1;
+    struct addrinfo* addr;
+    for (addr = server_addrs; addr != NULL; addr = addr->ai_next) {
+        if ((socket_fd = socket(addr->ai_family, addr->ai_socktype,
+                addr->ai_protocol)) < 0) {
+            continue;
+        }
+
+        if (socket_apply_profile(socket_fd, profile) < 0) {
+            perror("warning: couldn't apply socket profile");
+        }
+
+        if (connect(socket_fd, addr->ai_addr, addr->ai_addrlen) == 0)
+            break;
+
+        close(socket_fd);
+    }
+
+    freeaddrinfo(server_addrs);
+
+    if (addr == NULL) {
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+int connection_open(struct connection* connection, const char* host,
+        const char* service, bool datagrams,
+        const struct socket_profile* profile) {
+    connection->fd = connect_to_server(host, service,
+            datagrams ? SOCK_DGRAM : SOCK_STREAM, profile);
+    if (connection->fd < 0) {
+        return -1;
+    }
+
+    connection->version = PROTOCOL_V1;
+    connection->capabilities = 0;
+    connection->send_start = 0;
+    connection->send_length = 0;
+    connection->queue_start = 0;
+    connection->queue_length = 0;
+    memset(connection->pressed_keys, 0, sizeof(connection->pressed_keys));
+    memset(&connection->stats, 0, sizeof(connection->stats));
+    connection->receive_length = 0;
+    clock_gettime(CLOCK_MONOTONIC, &connection->last_heard);
+
+    connection->datagrams = datagrams;
+    connection->seq = 0;
+    connection->key_seq = 0;
+    connection->reliable_count = 0;
+    connection->pointer_x = 0;
+    connection->pointer_y = 0;
+    connection->unsent = false;
+
+    if (datagrams) {
+        /* There's no handshake for datagrams, which always use version 2 */
+        connection->version = PROTOCOL_V2;
+        connection->capabilities = PROTOCOL_CAP_FRAMES |
+            PROTOCOL_CAP_RELEASE_ALL;
+    }
+
+    return 0;
+}
+
+static int read_handshake_reply(int connection, uint8_t* reply,
+        size_t reply_size) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t received = 0;
+    while (received < reply_size) {
+        struct pollfd pfd = {
+            .fd = connection,
+            .events = POLLIN
+        };
+
+        int64_t remaining_ms = PROTOCOL_HANDSHAKE_TIMEOUT_MS -
+            (int64_t) (elapsed_ns(&start, NULL) / 1000000);
+        if (remaining_ms <= 0 || poll(&pfd, 1, remaining_ms) == 0) {
+            return -1;
+        }
+
+        ssize_t res = read(connection, &reply[received],
+                reply_size - received);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        } else if (res <= 0) {
+            return -1;
+        }
+
+        received += res;
+    }
+
+    return 0;
+}
+
+int connection_negotiate(struct connection* connection, int version) {
+    if (version == PROTOCOL_V1 || connection->datagrams) {
+        return 0;
+    }
+
+    struct client_event handshake[] = {
+        { .type = EV_CAPABILITIES, .value = PROTOCOL_CAPABILITIES },
+        { .type = EV_HELLO, .value = version }
+    };
+
+    uint8_t request[2 * EV_MSG_SIZE];
+    protocol_encode_event(PROTOCOL_V1, &handshake[0], &request[0]);
+    protocol_encode_event(PROTOCOL_V1, &handshake[1], &request[EV_MSG_SIZE]);
+    if (write(connection->fd, request, sizeof(request)) !=
+            ssizeof(request)) {
+        perror("error sending handshake");
+        return -1;
+    }
+
+    /* Servers not knowing about version 2 won't answer at all. Without an
+     * acknowledgement, servers which do stay with version 1 as well */
+    uint8_t reply[2 * EV_MSG_SIZE];
+    if (read_handshake_reply(connection->fd, reply, sizeof(reply)) < 0) {
+        return 0;
+    }
+
+    protocol_decode_event(PROTOCOL_V1, &reply[0], EV_MSG_SIZE, &handshake[0]);
+    protocol_decode_event(PROTOCOL_V1, &reply[EV_MSG_SIZE], EV_MSG_SIZE,
+            &handshake[1]);
+    if (handshake[0].type != EV_CAPABILITIES || handshake[1].type != EV_HELLO ||
+            handshake[1].value < PROTOCOL_V1 || handshake[1].value > version) {
+        fprintf(stderr, "Bad handshake reply from server\n");
+        return 0;
+    }
+
+    /* The server switches over once it has this */
+    uint8_t ack[EV_MSG_SIZE];
+    protocol_encode_event(PROTOCOL_V1, &handshake[1], ack);
+    if (write(connection->fd, ack, sizeof(ack)) != ssizeof(ack)) {
+        perror("error acknowledging handshake");
+        return -1;
+    }
+
+    connection->capabilities = handshake[0].value & PROTOCOL_CAPABILITIES;
+    connection->version = handshake[1].value;
+
+    return 0;
+}
+
+static void send_datagram(struct connection* connection) {
+    uint8_t datagram[DATAGRAM_MAX_SIZE];
+
+    struct datagram_header header = {
+        .seq = connection->seq++,
+        .key_seq = connection->key_seq,
+        .key_count = connection->reliable_count
+    };
+    size_t length = protocol_encode_datagram_header(&header, datagram);
+
+    for (size_t i = 0; i < connection->reliable_count; i++) {
+        length += protocol_encode_event(PROTOCOL_V2,
+                &connection->reliable[i], &datagram[length]);
+    }
+
+    /* The accumulated motion is always included, in case the datagram last
+     * carrying it was lost */
+    struct client_event pointer_x = {
+        .type = EV_POINTER_X,
+        .value = connection->pointer_x
+    };
+    struct client_event pointer_y = {
+        .type = EV_POINTER_Y,
+        .value = connection->pointer_y
+    };
+    length += protocol_encode_event(PROTOCOL_V2, &pointer_x, &datagram[length]);
+    length += protocol_encode_event(PROTOCOL_V2, &pointer_y, &datagram[length]);
+
+    if (send(connection->fd, datagram, length, 0) < 0 &&
+            errno != ECONNREFUSED) {
+        perror("error sending datagram");
+    }
+
+    connection->unsent = false;
+    clock_gettime(CLOCK_MONOTONIC, &connection->last_sent);
+}
+
+/* Writes as much of the send buffer as the socket takes without blocking.
+ * Returns -1 if the socket is full or broken, otherwise 0.
+ */
+static int write_send_buffer(struct connection* connection) {
+    while (connection->send_length > 0) {
+        ssize_t res = send(connection->fd,
+                &connection->send_buffer[connection->send_start],
+                connection->send_length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("error sending events");
+                /* Drop the data, the broken connection is noticed by
+                 * connection_handle_input() */
+                connection->send_length = 0;
+            }
+            return -1;
+        }
+
+        connection->send_start += res;
+        connection->send_length -= res;
+    }
+
+    connection->send_start = 0;
+
+    return 0;
+}
+
+static bool is_motion(uint16_t type) {
+    return type == EV_MOUSE_DX || type == EV_MOUSE_DY ||
+        type == EV_WHEEL || type == EV_HWHEEL;
+}
+
+static struct queued_event* queued_event(struct connection* connection,
+        size_t index) {
+    return &connection->queue[connection->queue_start + index];
+}
+
+static void track_key_state(struct connection* connection,
+        const struct client_event* event) {
+    if (event->value < 0 || event->value > CONNECTION_MAX_KEYCODE) {
+        return;
+    }
+
+    uint8_t* byte = &connection->pressed_keys[event->value / 8];
+    uint8_t bit = 1 << (event->value % 8);
+    if (event->type == EV_KEY_DOWN) {
+        *byte |= bit;
+    } else if (event->type == EV_KEY_UP) {
+        *byte &= ~bit;
+    }
+}
+
+static void append_event(struct connection* connection,
+        const struct client_event* event) {
+    if (connection->queue_start + connection->queue_length ==
+            EVENT_QUEUE_SIZE) {
+        memmove(connection->queue, queued_event(connection, 0),
+                connection->queue_length * sizeof(connection->queue[0]));
+        connection->queue_start = 0;
+    }
+
+    struct queued_event* queued = queued_event(connection,
+            connection->queue_length++);
+    queued->event = *event;
+    clock_gettime(CLOCK_MONOTONIC, &queued->queued);
+}
+
+/* Replaces everything queued with releasing all keys, followed by pressing
+ * the keys still held. Without support for that in the server, only the
+ * queued motion is dropped.
+ */
+static void resync_key_state(struct connection* connection) {
+    size_t queue_start = connection->queue_start;
+    size_t queue_length = connection->queue_length;
+    connection->queue_start = 0;
+    connection->queue_length = 0;
+
+    if (!(connection->capabilities & PROTOCOL_CAP_RELEASE_ALL)) {
+        for (size_t i = 0; i < queue_length; i++) {
+            struct queued_event* queued = &connection->queue[queue_start + i];
+            if (is_motion(queued->event.type)) {
+                connection->stats.dropped++;
+            } else {
+                connection->queue[connection->queue_length++] = *queued;
+            }
+        }
+        return;
+    }
+
+    connection->stats.dropped += queue_length;
+    connection->stats.resyncs++;
+
+    struct client_event release_all = { .type = EV_RELEASE_ALL };
+    append_event(connection, &release_all);
+
+    for (int32_t key = 0; key <= CONNECTION_MAX_KEYCODE; key++) {
+        if (connection->pressed_keys[key / 8] & (1 << (key % 8))) {
+            struct client_event key_down = {
+                .type = EV_KEY_DOWN,
+                .value = key
+            };
+            append_event(connection, &key_down);
+        }
+    }
+}
+
+static void queue_stream_event(struct connection* connection,
+        const struct client_event* event) {
+    if (event->type == EV_FRAME_BEGIN || event->type == EV_FRAME_END) {
+        /* Frames are put back together when encoding, see
+         * fill_send_buffer() */
+        return;
+    }
+
+    if (is_motion(event->type)) {
+        /* Add to motion of the same kind queued after the last key event */
+        for (size_t i = connection->queue_length; i > 0; i--) {
+            struct client_event* queued = &queued_event(connection,
+                    i - 1)->event;
+            if (!is_motion(queued->type)) {
+                break;
+            } else if (queued->type == event->type) {
+                queued->value += event->value;
+                if (queued->time == 0) {
+                    queued->time = event->time;
+                }
+                connection->stats.merged++;
+                return;
+            }
+        }
+    } else {
+        track_key_state(connection, event);
+    }
+
+    if (connection->queue_length == EVENT_QUEUE_SIZE) {
+        resync_key_state(connection);
+
+        if (connection->queue_length == EVENT_QUEUE_SIZE) {
+            fprintf(stderr, "Event queue full, dropping event %u\n",
+                    event->type);
+            connection->stats.dropped++;
+            return;
+        }
+
+        if ((connection->capabilities & PROTOCOL_CAP_RELEASE_ALL) &&
+                !is_motion(event->type)) {
+            /* The resync already reflects this event */
+            return;
+        }
+    }
+
+    append_event(connection, event);
+}
+
+static void compact_send_buffer(struct connection* connection) {
+    if (connection->send_start > 0) {
+        memmove(connection->send_buffer,
+                &connection->send_buffer[connection->send_start],
+                connection->send_length);
+        connection->send_start = 0;
+    }
+}
+
+static void encode_event(struct connection* connection,
+        const struct client_event* event) {
+    connection->send_length += protocol_encode_event(connection->version,
+            event, &connection->send_buffer[connection->send_length]);
+}
+
+/* Encodes queued events into the send buffer, as far as they fit */
+static void fill_send_buffer(struct connection* connection) {
+    compact_send_buffer(connection);
+
+    bool frames = connection->capabilities & PROTOCOL_CAP_FRAMES;
+    bool timestamps = connection->capabilities & PROTOCOL_CAP_TIMESTAMPS;
+    while (connection->queue_length > 0 && connection->send_length +
+            5 * PROTOCOL_MAX_MSG_SIZE <= sizeof(connection->send_buffer)) {
+        /* Motion along both axes is sent as one frame */
+        size_t count = frames && connection->queue_length > 1 &&
+            queued_event(connection, 0)->event.type == EV_MOUSE_DX &&
+            queued_event(connection, 1)->event.type == EV_MOUSE_DY ? 2 : 1;
+
+        struct client_event frame = { .type = EV_FRAME_BEGIN };
+        if (count == 2) {
+            encode_event(connection, &frame);
+        }
+
+        /* A frame is stamped with the capture time of its first event */
+        uint32_t captured = queued_event(connection, 0)->event.time;
+        if (timestamps && captured != 0) {
+            struct client_event timestamp = {
+                .type = EV_TIMESTAMP,
+                .value = captured
+            };
+            encode_event(connection, &timestamp);
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            encode_event(connection, &queued_event(connection, i)->event);
+        }
+
+        if (count == 2) {
+            frame.type = EV_FRAME_END;
+            encode_event(connection, &frame);
+        }
+
+        connection->queue_start += count;
+        connection->queue_length -= count;
+    }
+
+    if (connection->queue_length == 0) {
+        connection->queue_start = 0;
+    }
+}
+
+static void drop_stale_events(struct connection* connection) {
+    if (connection->queue_length > 0 &&
+            elapsed_ns(&queued_event(connection, 0)->queued, NULL) /
+            1000000 >= EVENT_QUEUE_STALE_MS) {
+        resync_key_state(connection);
+    }
+}
+
+static void flush_stream(struct connection* connection) {
+    drop_stale_events(connection);
+
+    do {
+        fill_send_buffer(connection);
+    } while (connection->send_length > 0 && write_send_buffer(connection) == 0);
+}
+
+short connection_poll_events(const struct connection* connection) {
+    bool blocked = !connection->datagrams && connection->send_length > 0;
+    return blocked ? POLLIN | POLLOUT : POLLIN;
+}
+
+static void add_datagram_event(struct connection* connection,
+        const struct client_event* event) {
+    switch (event->type) {
+        case EV_MOUSE_DX:
+            connection->pointer_x += event->value;
+            break;
+        case EV_MOUSE_DY:
+            connection->pointer_y += event->value;
+            break;
+        default:
+            /* Reliable events are applied before the motion of the datagram
+             * carrying them, so send off any earlier motion first */
+            if (connection->unsent) {
+                send_datagram(connection);
+            }
+
+            connection->reliable[connection->reliable_count++] = *event;
+            break;
+    }
+
+    if (!connection->unsent) {
+        connection->unsent = true;
+        clock_gettime(CLOCK_MONOTONIC, &connection->first_queued);
+    }
+
+    if (elapsed_ns(&connection->first_queued, NULL) >=
+            SEND_BUFFER_MAX_DELAY_NS) {
+        send_datagram(connection);
+    }
+}
+
+/* Pointer motion goes in the unreliable part of datagrams */
+static bool is_reliable(uint16_t type) {
+    return type != EV_MOUSE_DX && type != EV_MOUSE_DY;
+}
+
+/* Passes events held back in the event queue on to the datagram, as far as
+ * there is room for reliable events */
+static void pass_held_events(struct connection* connection) {
+    while (connection->queue_length > 0 && (connection->reliable_count <
+                DATAGRAM_MAX_RELIABLE_EVENTS ||
+                !is_reliable(queued_event(connection, 0)->event.type))) {
+        struct client_event event = queued_event(connection, 0)->event;
+        connection->queue_start++;
+        connection->queue_length--;
+        add_datagram_event(connection, &event);
+    }
+
+    if (connection->queue_length == 0) {
+        connection->queue_start = 0;
+    }
+}
+
+/* Once the server has fallen behind acknowledging reliable events, further
+ * events are held back in the event queue like on stream connections, motion
+ * included to keep it in order with them. There they are merged, or replaced
+ * by a key state resync once too many or too old.
+ */
+static void queue_datagram_event(struct connection* connection,
+        const struct client_event* event) {
+    if (event->type == EV_FRAME_BEGIN || event->type == EV_FRAME_END) {
+        /* The motion of a datagram is always applied as one frame */
+        return;
+    }
+
+    if (connection->queue_length > 0 || (is_reliable(event->type) &&
+                connection->reliable_count == DATAGRAM_MAX_RELIABLE_EVENTS)) {
+        queue_stream_event(connection, event);
+        return;
+    }
+
+    track_key_state(connection, event);
+    add_datagram_event(connection, event);
+}
+
+void connection_flush(struct connection* connection) {
+    if (connection->datagrams) {
+        drop_stale_events(connection);
+        pass_held_events(connection);
+        if (connection->unsent) {
+            send_datagram(connection);
+        }
+        return;
+    }
+
+    flush_stream(connection);
+}
+
+void connection_queue_event(struct connection* connection,
+        const struct client_event* event) {
+    if (connection->datagrams) {
+        queue_datagram_event(connection, event);
+    } else {
+        queue_stream_event(connection, event);
+    }
+}
+
+int connection_timeout(const struct connection* connection) {
+    int64_t remaining_ms;
+    if (connection->datagrams) {
+        /* Without anything to retransmit, the datagram is a heartbeat */
+        remaining_ms = (connection->reliable_count > 0 ?
+                DATAGRAM_RETRANSMIT_MS : PROTOCOL_HEARTBEAT_INTERVAL_MS) -
+            (int64_t) (elapsed_ns(&connection->last_sent, NULL) / 1000000);
+    } else if (connection->capabilities & PROTOCOL_CAP_HEARTBEAT) {
+        remaining_ms = CONNECTION_HEARTBEAT_TIMEOUT_MS -
+            (int64_t) (elapsed_ns(&connection->last_heard, NULL) / 1000000);
+    } else {
+        return -1;
+    }
+
+    return remaining_ms > 0 ? remaining_ms : 0;
+}
+
+int connection_handle_timeout(struct connection* connection) {
+    if (connection_timeout(connection) != 0) {
+        return 0;
+    }
+
+    if (connection->datagrams) {
+        send_datagram(connection);
+        return 0;
+    }
+
+    fprintf(stderr, "No heartbeat from server for %d ms\n",
+            CONNECTION_HEARTBEAT_TIMEOUT_MS);
+    return -1;
+}
+
+static void handle_acknowledgement(struct connection* connection,
+        const uint8_t* datagram, size_t length) {
+    struct datagram_header header;
+    if (protocol_decode_datagram_header(datagram, length, &header) < 0) {
+        return;
+    }
+
+    uint32_t acknowledged = header.key_seq - connection->key_seq;
+    if (acknowledged == 0 || acknowledged > connection->reliable_count) {
+        return;
+    }
+
+    connection->reliable_count -= acknowledged;
+    memmove(connection->reliable, &connection->reliable[acknowledged],
+            connection->reliable_count * sizeof(connection->reliable[0]));
+    connection->key_seq = header.key_seq;
+
+    /* Events held back for room are sent right away */
+    if (connection->queue_length > 0) {
+        connection_flush(connection);
+    }
+}
+
+/* Answers a clock ping ahead of anything still queued, as queueing would
+ * only add to the round trip. Without room, the ping goes unanswered. */
+static void answer_ping(struct connection* connection,
+        const struct client_event* ping) {
+    compact_send_buffer(connection);
+    if (connection->send_length + 2 * PROTOCOL_MAX_MSG_SIZE >
+            sizeof(connection->send_buffer)) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    struct client_event timestamp = {
+        .type = EV_TIMESTAMP,
+        .value = protocol_timestamp(&now)
+    };
+    struct client_event pong = {
+        .type = EV_PONG,
+        .value = ping->value
+    };
+    encode_event(connection, &timestamp);
+    encode_event(connection, &pong);
+
+    write_send_buffer(connection);
+}
+
+/* Decodes what the stream server has sent, returning -1 if it's garbage */
+static int handle_server_events(struct connection* connection) {
+    size_t start = 0;
+    for (;;) {
+        struct client_event event;
+        ssize_t length = protocol_decode_event(connection->version,
+                &connection->receive_buffer[start],
+                connection->receive_length - start, &event);
+        if (length < 0) {
+            fprintf(stderr, "Malformed message from server\n");
+            return -1;
+        } else if (length == 0) {
+            break;
+        }
+
+        start += length;
+
+        if (event.type == EV_PING) {
+            answer_ping(connection, &event);
+        }
+    }
+
+    connection->receive_length -= start;
+    memmove(connection->receive_buffer, &connection->receive_buffer[start],
+            connection->receive_length);
+
+    return 0;
+}
+
+int connection_handle_input(struct connection* connection) {
+    uint8_t buffer[DATAGRAM_MAX_SIZE];
+
+    for (;;) {
+        if (!connection->datagrams) {
+            ssize_t length = recv(connection->fd,
+                    &connection->receive_buffer[connection->receive_length],
+                    sizeof(connection->receive_buffer) -
+                    connection->receive_length, MSG_DONTWAIT);
+            if (length < 0 && errno == EINTR) {
+                continue;
+            } else if (length < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            } else if (length == 0) {
+                return -1;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &connection->last_heard);
+            connection->receive_length += length;
+            if (handle_server_events(connection) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        ssize_t length = recv(connection->fd, buffer, sizeof(buffer),
+                MSG_DONTWAIT);
+        if (length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            /* Datagrams are refused while the daemon is restarted */
+            return errno == EAGAIN || errno == EWOULDBLOCK ||
+                (connection->datagrams && errno == ECONNREFUSED) ? 0 : -1;
+        }
+
+        handle_acknowledgement(connection, buffer, length);
+    }
+}
+
+void connection_close(struct connection* connection) {
+    if (connection->datagrams) {
+        /* Tell the server to end the session, waiting a while for it to
+         * acknowledge so that keys aren't left pressed */
+        struct client_event disconnect = { .type = EV_DISCONNECT };
+        connection_queue_event(connection, &disconnect);
+        connection_flush(connection);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while ((connection->reliable_count > 0 ||
+                    connection->queue_length > 0) &&
+                elapsed_ns(&start, NULL) / 1000000 <
+                CONNECTION_CLOSE_TIMEOUT_MS) {
+            struct pollfd pfd = {
+                .fd = connection->fd,
+                .events = POLLIN
+            };
+
+            if (poll(&pfd, 1, connection_timeout(connection)) > 0) {
+                connection_handle_input(connection);
+            }
+            connection_handle_timeout(connection);
+        }
+    } else {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        connection_flush(connection);
+        while ((connection->send_length > 0 || connection->queue_length > 0) &&
+                elapsed_ns(&start, NULL) / 1000000 <
+                CONNECTION_CLOSE_TIMEOUT_MS) {
+            struct pollfd pfd = {
+                .fd = connection->fd,
+                .events = POLLOUT
+            };
+
+            if (poll(&pfd, 1, CONNECTION_CLOSE_TIMEOUT_MS) < 0 ||
+                    (pfd.revents & (POLLERR | POLLHUP))) {
+                break;
+            }
+            connection_flush(connection);
+        }
+    }
+
+    close(connection->fd);
+    connection->fd = -1;
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _CONNECTION_H_
+#define _CONNECTION_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "protocol.h"
+#include "shared.h"
+#include "socket_profile.h"
+
+/* Queued events are sent on connection_flush(), or when either of these
+ * limits is hit while working through a long queue */
+#define SEND_BUFFER_SIZE (64 * PROTOCOL_MAX_MSG_SIZE)
+#define SEND_BUFFER_MAX_DELAY_NS (2 * 1000 * 1000)
+
+/* Events waiting for room in the send buffer of a stream connection */
+#define EVENT_QUEUE_SIZE 256
+
+/* Events still queued after this long are no use replaying, and the key state
+ * is resynchronized instead */
+#define EVENT_QUEUE_STALE_MS 250
+
+/* Highest key code tracked for resynchronizing the key state */
+#define CONNECTION_MAX_KEYCODE 0x2ff
+
+/* Interval between retransmissions of unacknowledged reliable events */
+#define DATAGRAM_RETRANSMIT_MS 20
+
+/* Time given to send what's left when closing the connection, and for the
+ * server to acknowledge the end of a datagram session */
+#define CONNECTION_CLOSE_TIMEOUT_MS 500
+
+/* A server taking part in heartbeats is given up on once nothing has been
+ * heard from it for this long */
+#define CONNECTION_HEARTBEAT_TIMEOUT_MS (10 * PROTOCOL_HEARTBEAT_INTERVAL_MS)
+
+struct queued_event {
+    struct client_event event;
+    struct timespec queued;
+};
+
+struct connection_stats {
+    /* Motion events added to an earlier queued one */
+    uint64_t merged;
+    /* Events discarded for being stale */
+    uint64_t dropped;
+    /* Times the key state was resynchronized */
+    uint64_t resyncs;
+};
+
+struct connection {
+    int fd;
+    int version;
+    uint16_t capabilities;
+
+    /* Encoded data not written yet lives between send_start and
+     * send_start + send_length */
+    uint8_t send_buffer[SEND_BUFFER_SIZE];
+    size_t send_start;
+    size_t send_length;
+    struct timespec first_queued;
+
+    /* Stream transport events not yet encoded, between queue_start and
+     * queue_start + queue_length */
+    struct queued_event queue[EVENT_QUEUE_SIZE];
+    size_t queue_start;
+    size_t queue_length;
+    /* Keys held according to the events queued so far */
+    uint8_t pressed_keys[CONNECTION_MAX_KEYCODE / 8 + 1];
+
+    struct connection_stats stats;
+
+    /* Stream transport data received from the server and not decoded yet */
+    uint8_t receive_buffer[DATAGRAM_MAX_SIZE];
+    size_t receive_length;
+    struct timespec last_heard;
+
+    /* Datagram transport state, see protocol.h */
+    bool datagrams;
+    uint32_t seq;
+    /* Sequence number of reliable[0] */
+    uint32_t key_seq;
+    struct client_event reliable[DATAGRAM_MAX_RELIABLE_EVENTS];
+    size_t reliable_count;
+    int32_t pointer_x;
+    int32_t pointer_y;
+    /* Set when there is something not yet sent at least once */
+    bool unsent;
+    struct timespec last_sent;
+};
+
+/* Connects to the server, using the datagram transport if datagrams is set,
+ * with profile applied to the socket. Returns 0 on success or -1 on error.
+ */
+int connection_open(struct connection* connection, const char* host,
+        const char* service, bool datagrams,
+        const struct socket_profile* profile);
+
+/* Negotiates the protocol version to use, offering version at most. Falls
+ * back to version 1 if the server doesn't answer. Returns -1 if the
+ * connection can't be used, having failed halfway through, otherwise 0.
+ */
+int connection_negotiate(struct connection* connection, int version);
+
+/* Queues an event to be sent on the next flush. On stream connections, motion
+ * is added to motion queued since the last key or button event, keeping the
+ * capture time of the earliest.
+ */
+void connection_queue_event(struct connection* connection,
+        const struct client_event* event);
+
+/* Sends as much of what is queued as possible without blocking */
+void connection_flush(struct connection* connection);
+
+/* Returns the poll() events to wait for on the connection */
+short connection_poll_events(const struct connection* connection);
+
+/* Returns the number of milliseconds until connection_handle_timeout() should
+ * be called, or -1 if there's nothing to wait for.
+ */
+int connection_timeout(const struct connection* connection);
+
+/* Retransmits datagrams, or sends one to keep the session alive. Returns -1
+ * if the server has stopped taking part in heartbeats, otherwise 0.
+ */
+int connection_handle_timeout(struct connection* connection);
+
+/* Handles data sent by the server when the connection is readable, answering
+ * clock pings. Returns -1 if the server has gone away, otherwise 0.
+ */
+int connection_handle_input(struct connection* connection);
+
+void connection_close(struct connection* connection);
+
+#endif /* _CONNECTION_H_ */
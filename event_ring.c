@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "event_ring.h"
+
+#define RING_INDEX(i) ((i) & (EVENT_RING_SIZE - 1))
+
+void event_ring_init(struct event_ring* ring) {
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+}
+
+bool event_ring_push(struct event_ring* ring,
+        const struct client_event* event) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail == EVENT_RING_SIZE) {
+        return false;
+    }
+
+    ring->events[RING_INDEX(head)] = *event;
+
+    /* Publish the event before the consumer can see the new head */
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    return true;
+}
+
+size_t event_ring_pop(struct event_ring* ring, struct client_event* events,
+        size_t count) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    size_t available = head - tail;
+    if (count > available) {
+        count = available;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        events[i] = ring->events[RING_INDEX(tail + i)];
+    }
+
+    /* Hand the slots back to the producer only once they've been copied */
+    atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+
+    return count;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _EVENT_RING_H_
+#define _EVENT_RING_H_
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "shared.h"
+
+/* Must be a power of two */
+#define EVENT_RING_SIZE 1024
+
+/* Keeps the producer and consumer indices on separate cache lines */
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Bounded queue of events passed from a single producer thread to a single
+ * consumer thread without locking. The indices only ever grow, wrapping
+ * around naturally, and are masked when indexing the array.
+ */
+struct event_ring {
+    struct client_event events[EVENT_RING_SIZE];
+
+    /* Written by the producer only */
+    alignas(CACHE_LINE_SIZE) atomic_size_t head;
+    /* Written by the consumer only */
+    alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+};
+
+void event_ring_init(struct event_ring* ring);
+
+/* Adds an event to the ring from the producer thread. Returns false if the
+ * ring is full.
+ */
+bool event_ring_push(struct event_ring* ring, const struct client_event* event);
+
+/* Takes up to count events off the ring from the consumer thread. Returns the
+ * number of events taken.
+ */
+size_t event_ring_pop(struct event_ring* ring, struct client_event* events,
+        size_t count);
+
+#endif /* _EVENT_RING_H_ */
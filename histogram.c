@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "histogram.h"
+
+#include <string.h>
+
+static size_t bucket_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+
+    if (value >> HISTOGRAM_MAX_BITS) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+
+    /* Values in [2^n, 2^(n+1)) share a group of buckets, each covering
+     * 2^(n - HISTOGRAM_SUB_BITS) values */
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS +
+        (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+}
+
+static uint64_t bucket_highest_value(size_t index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t sub_bucket = index % HISTOGRAM_SUB_BUCKETS;
+    return ((HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << shift) - 1;
+}
+
+void histogram_init(struct histogram* histogram) {
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+void histogram_record(struct histogram* histogram, uint64_t value) {
+    histogram->counts[bucket_index(value)]++;
+    histogram->total++;
+
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+uint64_t histogram_percentile(const struct histogram* histogram,
+        double percentile) {
+    if (histogram->total == 0) {
+        return 0;
+    }
+
+    /* Rank of the value at the percentile, counting from 1 */
+    uint64_t rank = (uint64_t) (percentile / 100.0 * histogram->total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_highest_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bits of a value kept below its highest set bit, bounding the error of a
+ * recorded value to 1/2^HISTOGRAM_SUB_BITS */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+/* Values from 2^HISTOGRAM_MAX_BITS up all end up in the last bucket */
+#define HISTOGRAM_MAX_BITS 40
+
+#define HISTOGRAM_BUCKETS \
+        ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/*
+ * Log-linear histogram in the manner of HDR histograms. Values are counted in
+ * buckets picked by their highest set bit and the HISTOGRAM_SUB_BITS bits
+ * below it, so recording is a few instructions with no allocation or
+ * locking. A histogram is only ever written by a single thread.
+ */
+struct histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+void histogram_init(struct histogram* histogram);
+
+void histogram_record(struct histogram* histogram, uint64_t value);
+
+/* Returns the highest value equivalent to the one at the given percentile,
+ * or 0 for an empty histogram */
+uint64_t histogram_percentile(const struct histogram* histogram,
+        double percentile);
+
+#endif /* _HISTOGRAM_H_ */
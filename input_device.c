@@ -23,15 +23,13 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <dirent.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <fcntl.h>
-#include <limits.h>
 #include <linux/input.h>
 #include <linux/uinput.h>
+#include <time.h>
 #include <sys/ioctl.h>
-#include <sys/stat.h>
-#include <sys/time.h>
 
 #include "logging.h"
 #include "shared.h"
@@ -55,153 +53,6 @@
 #define BUTTON_PRESS    1
 #define BUTTON_RELEASE  0
 
-static int open_event_device(const char* sysfs_device) {
-    DIR* sysfs_dir = opendir(sysfs_device);
-    if (sysfs_dir == NULL) {
-        LOG_ERRNO("error reading device from %s", sysfs_device);
-        return -1;
-    }
-
-    struct dirent* node_entry;
-    int event_fd = -1;
-    while((node_entry = readdir(sysfs_dir)) != NULL && event_fd < 0) {
-        char path_buf[PATH_MAX];
-        snprintf(path_buf, PATH_MAX, "%s/%s", sysfs_device, node_entry->d_name);
-        struct stat stat_buf;
-        if (stat(path_buf, &stat_buf) < 0) {
-            LOG_ERRNO("stat error");
-            continue;
-        }
-
-        if (!S_ISDIR(stat_buf.st_mode) ||
-                strncmp(node_entry->d_name, "event", 5) != 0) {
-            continue;
-        }
-
-        snprintf(path_buf, PATH_MAX, "%s/%s/dev", sysfs_device,
-                node_entry->d_name);
-        FILE* dev_file = fopen(path_buf, "r");
-        if (dev_file == NULL) {
-            LOG_ERRNO("error opening %s", path_buf);
-            continue;
-        }
-
-        unsigned int major, minor;
-        if (fscanf(dev_file, "%u:%u", &major, &minor) != 2) {
-            LOG(ERROR, "error reading character device");
-            fclose(dev_file);
-            goto fallback;
-        }
-
-        fclose(dev_file);
-
-        snprintf(path_buf, PATH_MAX, "/dev/char/%u:%u", major, minor);
-        if ((event_fd = open(path_buf, O_WRONLY)) < 0) {
-            if (errno == ENOENT) {
-                /* The entry in /dev/char is a symlink to the actual input
-                 * device in /dev/input, but it is created asynchronously,
-                 * meaning it might not yet exist.
-                 */
-                goto fallback;
-            }
-
-            LOG_ERRNO("error opening event device %s", path_buf);
-        } else {
-            break;
-        }
-
-
-fallback:
-        snprintf(path_buf, PATH_MAX, "/dev/input/%s", node_entry->d_name);
-        if ((event_fd = open(path_buf, O_WRONLY)) < 0) {
-            LOG_ERRNO("error opening fallback event device %s", path_buf);
-        }
-
-        break;
-    }
-
-    closedir(sysfs_dir);
-
-    return event_fd;
-}
-
-static int read_sysfs_device_path(const char* device_name,
-        char* sysfs_device_path, size_t device_path_size) {
-    FILE* device_stream = fopen("/proc/bus/input/devices", "r");
-    if (device_stream == NULL) {
-        LOG_ERRNO("error opening /proc/bus/input/devices");
-        return -1;
-    }
-
-    char name_pattern[UINPUT_MAX_NAME_SIZE - 1 + sizeof("N: Name=\"\"\n")];
-    snprintf(name_pattern, sizeof(name_pattern), "N: Name=\"%.*s\"\n",
-            UINPUT_MAX_NAME_SIZE - 1, device_name);
-
-    int status = 0;
-    char* line = NULL;
-    size_t len = 0;
-    ssize_t read;
-    while ((read = getline(&line, &len, device_stream)) != -1) {
-        // First, find the correct device section
-        if (read > ssizeof(name_pattern) || strcmp(line, name_pattern) != 0) {
-            continue;
-        }
-
-        // Found it, now look for the line pointing to the sysfs device
-        while ((read = getline(&line, &len, device_stream)) != -1) {
-            const char sysfs_pattern[] = "S: Sysfs=";
-            ssize_t pattern_len = sizeof(sysfs_pattern) - 1 /* \0 */;
-            if (strncmp(line, sysfs_pattern, pattern_len) != 0) {
-                continue;
-            }
-
-            // Found this line as well, copy it and break out of both loops
-            ssize_t sysfs_len = sizeof("/sys") - 1 /* \0 */;
-            ssize_t device_len = read - pattern_len + sysfs_len;
-            if (device_len > (ssize_t)device_path_size) {
-                LOG(ERROR, "sysfs device path too long");
-                break;
-            }
-            snprintf(sysfs_device_path, device_len, "/sys%s",
-                    &line[pattern_len] /* skip past the leading pattern */);
-            goto exit;
-        }
-
-        break;
-    }
-
-    status = -1;
-    LOG(ERROR, "error reading sysfs device from procfs");
-
-exit:
-    free(line);
-    fclose(device_stream);
-    return status;
-}
-
-static int open_uinput_event_device(int uinput_fd, const char* device_name) {
-    char sysfs_device_path[] = "/sys/devices/virtual/input/inputNNNN";
-
-#if UINPUT_VERSION >= 4
-    size_t dirname_size = sizeof("/sys/devices/virtual/input/") - 1 /* \0 */;
-    size_t device_name_size = sizeof("inputNNNN");
-    if (ioctl(uinput_fd, UI_GET_SYSNAME(device_name_size),
-                &sysfs_device_path[dirname_size]) != -1) {
-        LOG(DEBUG, "created %s", sysfs_device_path);
-        return open_event_device(sysfs_device_path);
-    }
-#endif
-
-    if (read_sysfs_device_path(device_name, sysfs_device_path,
-                sizeof(sysfs_device_path)) != -1) {
-        LOG(DEBUG, "created %s", sysfs_device_path);
-        return open_event_device(sysfs_device_path);
-    }
-
-    return -1;
-}
-
-
 static int open_uinput_device(void) {
     int uinput_fd;
 
@@ -269,80 +120,228 @@ static int setup_uinput_device(int uinput_fd, const char* device_name) {
     return setup_uinput_device_v1(uinput_fd, device_name, &device_input_id);
 }
 
-int device_create(const char* device_name, struct input_device* device) {
-    if ((device->uinput_fd = open_uinput_device()) < 0) {
+static const struct {
+    const char* name;
+    unsigned int capabilities;
+} device_profiles[] = {
+    { "keyboard", DEVICE_PROFILE_KEYBOARD },
+    { "mouse", DEVICE_PROFILE_MOUSE },
+    { "full", DEVICE_PROFILE_FULL },
+    { "keys", DEVICE_CAP_KEYBOARD },
+    { "buttons", DEVICE_CAP_BUTTONS },
+    { "motion", DEVICE_CAP_MOTION },
+    { "wheel", DEVICE_CAP_WHEEL },
+    { "extra", DEVICE_CAP_EXTRA },
+    { "repeat", DEVICE_CAP_REPEAT },
+};
+
+int device_parse_profile(const char* profile, unsigned int* capabilities) {
+    unsigned int parsed = 0;
+    const char* name = profile;
+    while (*name != '\0') {
+        size_t length = strcspn(name, ",");
+        size_t i = 0;
+        while (i < sizeof(device_profiles) / sizeof(*device_profiles) &&
+                (strlen(device_profiles[i].name) != length ||
+                 strncmp(device_profiles[i].name, name, length) != 0)) {
+            i++;
+        }
+
+        if (i == sizeof(device_profiles) / sizeof(*device_profiles)) {
+            return -1;
+        }
+
+        parsed |= device_profiles[i].capabilities;
+        name += length;
+        if (*name == ',') {
+            name++;
+        }
+    }
+
+    if (parsed == 0) {
         return -1;
     }
 
-    IOCTL_BIND(device->uinput_fd, "error setting up device", error);
-    IOCTL(UI_SET_EVBIT, EV_KEY);
+    *capabilities = parsed;
+    return 0;
+}
 
-    for (uint16_t key = KEY_ESC; key < KEY_MAX; key++) {
+static bool has_key_capability(unsigned int capabilities, uint16_t key) {
 #ifdef ANDROID
-        if (key == BTN_TOUCH) {
-            /* BTN_TOUCH has been known to cause trouble on some devices */
-            continue;
-        }
+    if (key == BTN_TOUCH) {
+        /* BTN_TOUCH has been known to cause trouble on some devices */
+        return false;
+    }
 #endif
-        IOCTL(UI_SET_KEYBIT, key);
+
+    if (key < BTN_MISC) {
+        return capabilities & DEVICE_CAP_KEYBOARD;
+    } else if (key >= BTN_MOUSE && key < BTN_JOYSTICK) {
+        return capabilities & DEVICE_CAP_BUTTONS;
     }
 
-    IOCTL(UI_SET_EVBIT, EV_REL);
-    IOCTL(UI_SET_RELBIT, REL_X);
-    IOCTL(UI_SET_RELBIT, REL_Y);
-    IOCTL(UI_SET_RELBIT, REL_WHEEL);
-    IOCTL(UI_SET_RELBIT, REL_HWHEEL);
+    return capabilities & DEVICE_CAP_EXTRA;
+}
 
-    if (setup_uinput_device(device->uinput_fd, device_name) < 0) {
-        LOG_ERRNO_HERE("error setting up uinput device");
-        goto error;
+int device_prepare(const char* device_name, unsigned int capabilities,
+        struct input_device* device) {
+    device->created = false;
+    device->capabilities = capabilities;
+    device->repeat_delay = 0;
+    device->repeat_period = 0;
+    memset(device->pressed_keys, 0, sizeof(device->pressed_keys));
+    device->queued_events = 0;
+    device->in_frame = false;
+    device->output_start = 0;
+    device->output_length = 0;
+    device->stats = (struct device_stats) { 0 };
+    device->commit_latency = NULL;
+    snprintf(device->name, sizeof(device->name), "%s", device_name);
+
+    struct timespec start, opened, registered;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if ((device->uinput_fd = open_uinput_device()) < 0) {
+        return -1;
     }
+    clock_gettime(CLOCK_MONOTONIC, &opened);
 
-    IOCTL(UI_DEV_CREATE);
+    unsigned int key_count = 0;
+    IOCTL_BIND(device->uinput_fd, "error setting up device", error);
+    if (capabilities & (DEVICE_CAP_KEYBOARD | DEVICE_CAP_BUTTONS |
+                DEVICE_CAP_EXTRA)) {
+        IOCTL(UI_SET_EVBIT, EV_KEY);
+
+        for (uint16_t key = KEY_ESC; key < KEY_MAX; key++) {
+            if (has_key_capability(capabilities, key)) {
+                IOCTL(UI_SET_KEYBIT, key);
+                key_count++;
+            }
+        }
+    }
+
+    if (capabilities & DEVICE_CAP_REPEAT) {
+        IOCTL(UI_SET_EVBIT, EV_REP);
+    }
+
+    if (capabilities & (DEVICE_CAP_MOTION | DEVICE_CAP_WHEEL)) {
+        IOCTL(UI_SET_EVBIT, EV_REL);
+    }
+
+    if (capabilities & DEVICE_CAP_MOTION) {
+        IOCTL(UI_SET_RELBIT, REL_X);
+        IOCTL(UI_SET_RELBIT, REL_Y);
+    }
+
+    if (capabilities & DEVICE_CAP_WHEEL) {
+        IOCTL(UI_SET_RELBIT, REL_WHEEL);
+        IOCTL(UI_SET_RELBIT, REL_HWHEEL);
+    }
     IOCTL_END;
 
-    device->event_fd = open_uinput_event_device(device->uinput_fd, device_name);
-    if (device->event_fd < 0) {
-        LOG(WARNING, "unable to open event device!");
+    if (setup_uinput_device(device->uinput_fd, device_name) < 0) {
+        LOG_ERRNO_HERE("error setting up uinput device");
+        goto error;
     }
+    clock_gettime(CLOCK_MONOTONIC, &registered);
 
+    LOG(INFO, "set up %s in %.2f ms: open %.2f ms, %u keys %.2f ms",
+            device_name, elapsed_ns(&start, &registered) / 1e6,
+            elapsed_ns(&start, &opened) / 1e6, key_count,
+            elapsed_ns(&opened, &registered) / 1e6);
 
     return 0;
 
 error:
     close(device->uinput_fd);
+    device->uinput_fd = -1;
     return -1;
 }
 
-void device_release_all_keys(struct input_device* device) {
-    if (device->event_fd < 0) return;
+static void commit_event(struct input_device* device, uint16_t type,
+        uint16_t code, int32_t value);
+static void sync_device(struct input_device* device);
 
-    uint8_t keys[(KEY_MAX + (8 - 1)) / 8] = {0};
-    if (ioctl(device->event_fd, EVIOCGKEY(sizeof(keys)), &keys) == -1) {
-        LOG_ERRNO("ioctl");
+static void apply_repeat(struct input_device* device) {
+    if (!(device->capabilities & DEVICE_CAP_REPEAT)) {
         return;
     }
 
-    for (size_t i = 0; i < sizeof(keys); i++) {
-        if (keys[i] == 0) continue;
-        for (int j = 0; j < 8; j++) {
-            if (keys[i] & (1 << j)) {
-                device_key_up(device, (i*8) + j);
-            }
-        }
+    if (device->repeat_delay > 0) {
+        commit_event(device, EV_REP, REP_DELAY, device->repeat_delay);
     }
+    if (device->repeat_period > 0) {
+        commit_event(device, EV_REP, REP_PERIOD, device->repeat_period);
+    }
+    sync_device(device);
 }
 
-void device_close(struct input_device* device) {
-    device_release_all_keys(device);
+static int create_prepared_device(struct input_device* device) {
+    if (ioctl(device->uinput_fd, UI_DEV_CREATE) < 0) {
+        LOG_ERRNO("error creating %s", device->name);
+        return -1;
+    }
+
+    device->created = true;
+
+    /* The input core sets its default repeat rate on creation */
+    if (device->repeat_delay > 0 || device->repeat_period > 0) {
+        apply_repeat(device);
+    }
+
+    return 0;
+}
 
-    if (device->event_fd > 0 && close(device->event_fd < 0)) {
-        LOG_ERRNO("error closing event device");
+void device_set_repeat(struct input_device* device, int delay, int period) {
+    device->repeat_delay = delay;
+    device->repeat_period = period;
+
+    if (device->created) {
+        apply_repeat(device);
+    }
+}
+
+int device_create(const char* device_name, unsigned int capabilities,
+        struct input_device* device) {
+    if (device_prepare(device_name, capabilities, device) < 0) {
+        return -1;
     }
-    device->event_fd = -1;
 
-    if (ioctl(device->uinput_fd, UI_DEV_DESTROY) < 0) {
-        LOG_ERRNO("error closing device");
+    struct timespec start, created;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (create_prepared_device(device) < 0) {
+        close(device->uinput_fd);
+        device->uinput_fd = -1;
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &created);
+
+    LOG(INFO, "created %s in %.2f ms", device_name,
+            elapsed_ns(&start, &created) / 1e6);
+
+    return 0;
+}
+
+void device_close(struct input_device* device) {
+    if (device->created) {
+        device_release_all_keys(device);
+
+        /* Whatever uinput doesn't take now is lost */
+        device_flush_output(device);
+        device->stats.dropped += device->output_length;
+        device->output_length = 0;
+
+        if (device->stats.deferred > 0 || device->stats.dropped > 0) {
+            LOG(NOTICE, "%s: %" PRIu64 " deferred writes, %" PRIu64
+                    " dropped events, up to %zu events queued", device->name,
+                    device->stats.deferred, device->stats.dropped,
+                    device->stats.max_depth);
+        }
+
+        if (ioctl(device->uinput_fd, UI_DEV_DESTROY) < 0) {
+            LOG_ERRNO("error closing device");
+        }
     }
 
     if (close(device->uinput_fd) < 0) {
@@ -352,41 +351,182 @@ void device_close(struct input_device* device) {
     device->uinput_fd = -1;
 }
 
-static void commit_event(struct input_device* device,
-        struct input_event* event) {
-    gettimeofday(&event->time, NULL);
-    if (write(device->uinput_fd, event, sizeof(struct input_event)) < 0) {
-        LOG_ERRNO("error committing event");
+/* Returns the number of events uinput took, or -1 on errors other than it
+ * not being writable */
+static ssize_t write_events(struct input_device* device,
+        const struct input_event* events, size_t count) {
+    /* uinput accepts any number of events per write, and the input core
+     * timestamps them on arrival, so there's no need to set event.time */
+    struct timespec start, end;
+    if (device->commit_latency != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+
+    ssize_t written;
+    do {
+        written = write(device->uinput_fd, events, count * sizeof(*events));
+    } while (written < 0 && errno == EINTR);
+
+    if (device->commit_latency != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        histogram_record(device->commit_latency, elapsed_ns(&start, &end));
+    }
+
+    if (written < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+
+        LOG_ERRNO("error committing events");
+        return -1;
     }
+
+    return written / ssizeof(*events);
 }
 
-static void sync_device(struct input_device* device) {
-    static struct input_event sync_event = {
-        .type = EV_SYN,
-        .code = SYN_REPORT
+static void queue_output(struct input_device* device,
+        const struct input_event* events, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        /* Key transitions must never be lost, so motion is dropped before the
+         * queue fills up completely */
+        size_t limit = DEVICE_OUTPUT_QUEUE_SIZE;
+        if (events[i].type == EV_REL) {
+            limit -= DEVICE_OUTPUT_KEY_RESERVE;
+        }
+
+        if (device->output_length >= limit) {
+            device->stats.dropped++;
+            continue;
+        }
+
+        /* Nothing is left to report if all motion of a frame was dropped */
+        size_t end = (device->output_start + device->output_length) %
+            DEVICE_OUTPUT_QUEUE_SIZE;
+        size_t last = (end + DEVICE_OUTPUT_QUEUE_SIZE - 1) %
+            DEVICE_OUTPUT_QUEUE_SIZE;
+        if (events[i].type == EV_SYN && device->output_length > 0 &&
+                device->output_queue[last].type == EV_SYN) {
+            continue;
+        }
+
+        device->output_queue[end] = events[i];
+        device->output_length++;
+    }
+
+    if (device->output_length > device->stats.max_depth) {
+        device->stats.max_depth = device->output_length;
+    }
+}
+
+void device_flush_output(struct input_device* device) {
+    while (device->output_length > 0) {
+        size_t count = DEVICE_OUTPUT_QUEUE_SIZE - device->output_start;
+        if (count > device->output_length) {
+            count = device->output_length;
+        }
+
+        ssize_t written = write_events(device,
+                &device->output_queue[device->output_start], count);
+        if (written < 0) {
+            device->stats.dropped += device->output_length;
+            device->output_length = 0;
+            break;
+        }
+
+        device->output_start = (device->output_start + written) %
+            DEVICE_OUTPUT_QUEUE_SIZE;
+        device->output_length -= written;
+
+        if ((size_t)written < count) {
+            break;
+        }
+    }
+
+    if (device->output_length == 0) {
+        device->output_start = 0;
+    }
+}
+
+static void flush_events(struct input_device* device) {
+    if (device->queued_events == 0) {
+        return;
+    }
+
+    /* Events can't overtake those already waiting for uinput */
+    ssize_t written = 0;
+    if (device->output_length == 0) {
+        written = write_events(device, device->event_queue,
+                device->queued_events);
+    }
+
+    if (written < 0) {
+        device->stats.dropped += device->queued_events;
+    } else if ((size_t)written < device->queued_events) {
+        device->stats.deferred++;
+        queue_output(device, &device->event_queue[written],
+                device->queued_events - written);
+    }
+
+    device->queued_events = 0;
+}
+
+static void commit_event(struct input_device* device, uint16_t type,
+        uint16_t code, int32_t value) {
+    if (!device->created) {
+        if (create_prepared_device(device) < 0) {
+            return;
+        }
+
+        LOG(INFO, "created %s on its first event", device->name);
+    }
+
+    if (device->queued_events == DEVICE_EVENT_QUEUE_SIZE) {
+        flush_events(device);
+    }
+
+    device->event_queue[device->queued_events++] = (struct input_event) {
+        .type = type,
+        .code = code,
+        .value = value
     };
+}
 
-    commit_event(device, &sync_event);
+static void sync_device(struct input_device* device) {
+    if (device->in_frame) {
+        return;
+    }
+
+    commit_event(device, EV_SYN, SYN_REPORT, 0);
+    flush_events(device);
+}
+
+void device_begin_frame(struct input_device* device) {
+    device->in_frame = true;
+}
+
+void device_end_frame(struct input_device* device) {
+    if (!device->in_frame) {
+        return;
+    }
+
+    device->in_frame = false;
+
+    if (device->queued_events > 0) {
+        sync_device(device);
+    }
 }
 
 static void commit_mouse_event(struct input_device* device, uint16_t event_code_x,
         uint16_t event_code_y, int dx, int dy) {
     bool has_written = 0;
-    struct input_event event = {
-        .type = EV_REL
-    };
 
     if (dx != 0) {
-        event.code = event_code_x;
-        event.value = dx;
-        commit_event(device, &event);
+        commit_event(device, EV_REL, event_code_x, dx);
         has_written = 1;
     }
 
     if (dy != 0) {
-        event.code = event_code_y;
-        event.value = dy;
-        commit_event(device, &event);
+        commit_event(device, EV_REL, event_code_y, dy);
         has_written = 1;
     }
 
@@ -405,14 +545,22 @@ void device_mouse_wheel(struct input_device* device, int dx, int dy) {
     commit_mouse_event(device, REL_HWHEEL, REL_WHEEL, dx, dy);
 }
 
+#define KEY_BIT(keycode) (1 << ((keycode) % 8))
+
+static bool is_key_pressed(struct input_device* device, uint16_t keycode) {
+    return device->pressed_keys[keycode / 8] & KEY_BIT(keycode);
+}
+
 static void commit_device_key_event(struct input_device* device,
         uint16_t keycode, int32_t value) {
-    struct input_event event = {
-        .type = EV_KEY,
-        .code = keycode,
-        .value = value
-    };
-    commit_event(device, &event);
+    /* Transitions the kernel would see as redundant aren't passed on */
+    if (keycode > KEY_MAX || is_key_pressed(device, keycode) == value) {
+        return;
+    }
+
+    device->pressed_keys[keycode / 8] ^= KEY_BIT(keycode);
+
+    commit_event(device, EV_KEY, keycode, value);
     sync_device(device);
 }
 
@@ -425,3 +573,22 @@ void device_key_up(struct input_device* device, uint16_t keycode) {
     LOG(DEBUG, "KEY UP [%u]", keycode);
     commit_device_key_event(device, keycode, BUTTON_RELEASE);
 }
+
+void device_release_all_keys(struct input_device* device) {
+    bool released = false;
+    for (size_t i = 0; i < sizeof(device->pressed_keys); i++) {
+        if (device->pressed_keys[i] == 0) continue;
+        for (int j = 0; j < 8; j++) {
+            if (device->pressed_keys[i] & (1 << j)) {
+                commit_event(device, EV_KEY, (i*8) + j, BUTTON_RELEASE);
+                released = true;
+            }
+        }
+        device->pressed_keys[i] = 0;
+    }
+
+    /* All releases are reported at once */
+    if (released) {
+        sync_device(device);
+    }
+}
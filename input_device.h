@@ -19,17 +19,104 @@
 #ifndef _INPUT_DEVICE_H_
 #define _INPUT_DEVICE_H_
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#include "histogram.h"
+
+/* Number of events which can be queued before being written to uinput */
+#define DEVICE_EVENT_QUEUE_SIZE 16
+
+/* Events which uinput didn't take right away, kept until it's writable */
+#define DEVICE_OUTPUT_QUEUE_SIZE 256
+/* Output queue depth at which event sources should hold back */
+#define DEVICE_OUTPUT_HIGH_WATER (DEVICE_OUTPUT_QUEUE_SIZE / 2)
+/* Room in the output queue which motion may not take, kept for keys */
+#define DEVICE_OUTPUT_KEY_RESERVE 32
+
+/* Capabilities registered with a device. Registering keys takes one ioctl
+ * per key, so leaving out unneeded ones makes device creation faster */
+#define DEVICE_CAP_KEYBOARD (1 << 0) /* keyboard keys, below BTN_MISC */
+#define DEVICE_CAP_BUTTONS  (1 << 1) /* mouse buttons */
+#define DEVICE_CAP_MOTION   (1 << 2) /* relative pointer motion */
+#define DEVICE_CAP_WHEEL    (1 << 3) /* vertical and horizontal wheel */
+#define DEVICE_CAP_EXTRA    (1 << 4) /* all other keys up to KEY_MAX */
+#define DEVICE_CAP_REPEAT   (1 << 5) /* key repeats generated by the kernel */
+
+#define DEVICE_PROFILE_KEYBOARD (DEVICE_CAP_KEYBOARD | DEVICE_CAP_REPEAT)
+#define DEVICE_PROFILE_MOUSE \
+        (DEVICE_CAP_BUTTONS | DEVICE_CAP_MOTION | DEVICE_CAP_WHEEL)
+#define DEVICE_PROFILE_FULL \
+        (DEVICE_PROFILE_KEYBOARD | DEVICE_PROFILE_MOUSE | DEVICE_CAP_EXTRA)
+
+struct device_stats {
+    /* Writes which uinput didn't take in full, leaving events queued */
+    uint64_t deferred;
+    /* Events lost since the output queue was full, or uinput failed */
+    uint64_t dropped;
+    /* Most events queued for output at once */
+    size_t max_depth;
+};
 
 struct input_device {
     int uinput_fd;
-    int event_fd;
+
+    /* Cleared until the device has been created, which a device only set up
+     * with device_prepare() is on its first event */
+    bool created;
+    char name[UINPUT_MAX_NAME_SIZE];
+    unsigned int capabilities;
+
+    /* Key repeat delay and period in ms, or 0 for the kernel's defaults */
+    int repeat_delay;
+    int repeat_period;
+
+    /* Keys held down, as reported to the kernel */
+    uint8_t pressed_keys[(KEY_MAX + 8) / 8];
+
+    /* Events of the current frame, written with a single write() on sync */
+    struct input_event event_queue[DEVICE_EVENT_QUEUE_SIZE];
+    size_t queued_events;
+
+    /* Set while a frame is open, deferring SYN_REPORT until it's ended */
+    bool in_frame;
+
+    /* Ring buffer of events waiting for uinput to become writable */
+    struct input_event output_queue[DEVICE_OUTPUT_QUEUE_SIZE];
+    size_t output_start;
+    size_t output_length;
+
+    struct device_stats stats;
+    /* Records how long writes to uinput take, unless NULL */
+    struct histogram* commit_latency;
 };
 
-int device_create(const char* device_name, struct input_device* device);
+/* Parses a profile name (keyboard, mouse or full) or a comma separated list
+ * of capabilities (keys, buttons, motion, wheel, extra, repeat) */
+int device_parse_profile(const char* profile, unsigned int* capabilities);
+
+int device_create(const char* device_name, unsigned int capabilities,
+        struct input_device* device);
+
+/* Sets up a device like device_create(), but leaves creating it until its
+ * first event, so that it doesn't show up unless it's used */
+int device_prepare(const char* device_name, unsigned int capabilities,
+        struct input_device* device);
 
 void device_close(struct input_device* device);
 
+/* Sets how fast the kernel repeats held keys of a device with
+ * DEVICE_CAP_REPEAT, applied right away or once the device is created */
+void device_set_repeat(struct input_device* device, int delay, int period);
+
+/* Collects all events up until device_end_frame() into a single report */
+void device_begin_frame(struct input_device* device);
+
+void device_end_frame(struct input_device* device);
+
 void device_mouse_move(struct input_device*, int dx, int dy);
 
 void device_mouse_wheel(struct input_device*, int dx, int dy);
@@ -40,4 +127,16 @@ void device_key_up(struct input_device*, uint16_t keycode);
 
 void device_release_all_keys(struct input_device* device);
 
+/* Writes events left in the output queue, once uinput_fd is writable */
+void device_flush_output(struct input_device* device);
+
+static inline bool device_output_pending(const struct input_device* device) {
+    return device->output_length > 0;
+}
+
+/* Set when the output queue is deep enough for sources to stop decoding */
+static inline bool device_output_congested(const struct input_device* device) {
+    return device->output_length >= DEVICE_OUTPUT_HIGH_WATER;
+}
+
 #endif /* _INPUT_DEVICE_H_ */
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "jitter_buffer.h"
+
+#include <string.h>
+
+#define BUFFER_INDEX(i) ((i) % JITTER_BUFFER_SIZE)
+
+#define WINDOW_US (JITTER_BUFFER_WINDOW_MS * 1000)
+#define MAX_DELAY_US (JITTER_BUFFER_MAX_DELAY_MS * 1000)
+
+/* Timestamps wrap, so they are only compared by their difference */
+static bool before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+void jitter_buffer_init(struct jitter_buffer* buffer, uint32_t target_delay) {
+    buffer->target_delay = target_delay;
+    buffer->delay = target_delay;
+    buffer->start = 0;
+    buffer->length = 0;
+    buffer->timed = false;
+    buffer->last_due = 0;
+    buffer->in_frame = false;
+    buffer->frame_length = 0;
+    memset(&buffer->stats, 0, sizeof(buffer->stats));
+}
+
+static void track_transit(struct jitter_buffer* buffer, uint32_t transit,
+        uint32_t now) {
+    struct transit_window fresh = {
+        .start = now,
+        .lowest = transit,
+        .highest = transit
+    };
+    struct transit_window* current = &buffer->windows[1];
+
+    uint32_t elapsed = now - current->start;
+    if (!buffer->timed || elapsed >= 2 * WINDOW_US) {
+        buffer->windows[0] = fresh;
+        buffer->windows[1] = fresh;
+        buffer->timed = true;
+    } else if (elapsed >= WINDOW_US) {
+        buffer->windows[0] = *current;
+        *current = fresh;
+    } else if (before(transit, current->lowest)) {
+        current->lowest = transit;
+    } else if (before(current->highest, transit)) {
+        current->highest = transit;
+    }
+}
+
+static uint32_t lowest_transit(const struct jitter_buffer* buffer) {
+    const struct transit_window* windows = buffer->windows;
+    return before(windows[0].lowest, windows[1].lowest) ?
+        windows[0].lowest : windows[1].lowest;
+}
+
+static uint32_t highest_transit(const struct jitter_buffer* buffer) {
+    const struct transit_window* windows = buffer->windows;
+    return before(windows[0].highest, windows[1].highest) ?
+        windows[1].highest : windows[0].highest;
+}
+
+static void adapt_delay(struct jitter_buffer* buffer) {
+    uint32_t goal = highest_transit(buffer) - lowest_transit(buffer);
+    if (goal < buffer->target_delay) {
+        goal = buffer->target_delay;
+    } else if (goal > MAX_DELAY_US) {
+        goal = MAX_DELAY_US;
+    }
+
+    if (goal > buffer->delay) {
+        buffer->delay = goal;
+    } else {
+        buffer->delay -= (buffer->delay - goal) >> JITTER_BUFFER_SHRINK_SHIFT;
+    }
+}
+
+bool jitter_buffer_push(struct jitter_buffer* buffer,
+        const struct client_event* event, uint32_t now) {
+    if (buffer->length == JITTER_BUFFER_SIZE) {
+        return false;
+    }
+
+    uint32_t due = buffer->length > 0 ? buffer->last_due : now;
+    if (event->time != 0) {
+        track_transit(buffer, now - event->time, now);
+        adapt_delay(buffer);
+
+        uint32_t scheduled = event->time + lowest_transit(buffer) +
+            buffer->delay;
+        if (before(scheduled, now)) {
+            buffer->stats.late++;
+        }
+
+        /* Never ahead of events queued before it */
+        if (buffer->length == 0 || before(due, scheduled)) {
+            due = scheduled;
+        }
+    }
+
+    if (event->type == EV_FRAME_BEGIN) {
+        buffer->in_frame = true;
+        buffer->frame_length = 0;
+    }
+
+    if (buffer->in_frame) {
+        /* The frame goes out as a whole, when its last timestamp is due */
+        for (size_t i = buffer->length - buffer->frame_length;
+                i < buffer->length; i++) {
+            buffer->events[BUFFER_INDEX(buffer->start + i)].due = due;
+        }
+        buffer->frame_length++;
+    }
+
+    if (event->type == EV_FRAME_END) {
+        buffer->in_frame = false;
+    }
+
+    struct buffered_event* buffered =
+        &buffer->events[BUFFER_INDEX(buffer->start + buffer->length++)];
+    buffered->event = *event;
+    buffered->due = due;
+    buffer->last_due = due;
+
+    return true;
+}
+
+bool jitter_buffer_next_due(const struct jitter_buffer* buffer,
+        uint32_t* due) {
+    /* Nothing but the start of a frame, which may go on being delayed */
+    if (buffer->length == 0 ||
+            (buffer->in_frame && buffer->frame_length == buffer->length)) {
+        return false;
+    }
+
+    *due = buffer->events[buffer->start].due;
+
+    return true;
+}
+
+void jitter_buffer_shift(struct jitter_buffer* buffer,
+        struct client_event* event) {
+    *event = buffer->events[buffer->start].event;
+    buffer->start = BUFFER_INDEX(buffer->start + 1);
+    buffer->length--;
+
+    if (buffer->frame_length > buffer->length) {
+        buffer->frame_length = buffer->length;
+    }
+}
+
+bool jitter_buffer_pop(struct jitter_buffer* buffer, uint32_t now,
+        struct client_event* event) {
+    uint32_t due;
+    if (!jitter_buffer_next_due(buffer, &due) || before(now, due)) {
+        return false;
+    }
+
+    jitter_buffer_shift(buffer, event);
+
+    return true;
+}
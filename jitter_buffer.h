@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _JITTER_BUFFER_H_
+#define _JITTER_BUFFER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shared.h"
+
+/* Events held back at most, beyond which the earliest is played out early */
+#define JITTER_BUFFER_SIZE 256
+
+/* Transit times are tracked over two windows of this length, so the spread
+ * seen lately is remembered for between one and two windows */
+#define JITTER_BUFFER_WINDOW_MS 2000
+
+/* Upper bound of the delay, however bad the jitter */
+#define JITTER_BUFFER_MAX_DELAY_MS 100
+
+/* Shrinking the delay is spread out, taking 1/2^n of the difference for each
+ * timestamped event, to avoid playing out a burst whenever a window rotates */
+#define JITTER_BUFFER_SHRINK_SHIFT 6
+
+struct buffered_event {
+    struct client_event event;
+    /* Protocol timestamp of when the event is to be played out */
+    uint32_t due;
+};
+
+/* Lowest and highest transit time seen within a window */
+struct transit_window {
+    uint32_t start;
+    uint32_t lowest;
+    uint32_t highest;
+};
+
+struct jitter_buffer_stats {
+    /* Events arriving too late to keep their spacing */
+    uint64_t late;
+    /* Events played out early for lack of room */
+    uint64_t overflows;
+};
+
+/*
+ * Plays events out with the spacing they were captured with, rather than the
+ * spacing they arrived with. The transit time of an event is the time it
+ * arrived minus the client's timestamp, so it includes the offset between the
+ * two clocks, which cancels out. Each event is played out at its capture time
+ * plus the lowest transit time seen lately plus the delay. The delay covers
+ * the spread of transit times seen lately, with at least the target delay.
+ *
+ * Events without a timestamp, and frames, go along with the timestamped event
+ * before them. All times are protocol timestamps of CLOCK_MONOTONIC.
+ */
+struct jitter_buffer {
+    uint32_t target_delay;
+    uint32_t delay;
+
+    struct buffered_event events[JITTER_BUFFER_SIZE];
+    size_t start;
+    size_t length;
+
+    bool timed;
+    struct transit_window windows[2];
+    uint32_t last_due;
+
+    /* Events of the frame being queued, which are played out together */
+    bool in_frame;
+    size_t frame_length;
+
+    struct jitter_buffer_stats stats;
+};
+
+void jitter_buffer_init(struct jitter_buffer* buffer, uint32_t target_delay);
+
+static inline bool jitter_buffer_empty(const struct jitter_buffer* buffer) {
+    return buffer->length == 0;
+}
+
+/* Queues an event which arrived at now. Returns false if the buffer is full,
+ * in which case the earliest event has to be shifted out first.
+ */
+bool jitter_buffer_push(struct jitter_buffer* buffer,
+        const struct client_event* event, uint32_t now);
+
+/* Tells when the earliest event is due. Returns false if nothing can be
+ * played out before more events arrive, as when the buffer is empty or only
+ * holds part of a frame.
+ */
+bool jitter_buffer_next_due(const struct jitter_buffer* buffer,
+        uint32_t* due);
+
+/* Takes the earliest event into event, if it is due by now */
+bool jitter_buffer_pop(struct jitter_buffer* buffer, uint32_t now,
+        struct client_event* event);
+
+/* Takes the earliest event into event, whether it is due or not. The buffer
+ * must not be empty.
+ */
+void jitter_buffer_shift(struct jitter_buffer* buffer,
+        struct client_event* event);
+
+#endif /* _JITTER_BUFFER_H_ */
@@ -0,0 +1,7 @@
+/* THIS FILE IS GENERATED. DO NOT EDIT! */
+
+#include <stdint.h>
+
+uint16_t lookup_keycode(uint16_t keycode) {
+    return keycode;
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "protocol.h"
+
+#include <assert.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "shared.h"
+
+static size_t encode_event_v1(const struct client_event* event,
+        uint8_t* buffer) {
+    int32_t value = event->value;
+    if (value > INT16_MAX) {
+        value = INT16_MAX;
+    } else if (value < INT16_MIN) {
+        value = INT16_MIN;
+    }
+
+    EV_MSG_FIELD(buffer, type) = htons(event->type);
+    EV_MSG_FIELD(buffer, value) = htons((int16_t)value);
+
+    return EV_MSG_SIZE;
+}
+
+static size_t encode_event_v2(const struct client_event* event,
+        uint8_t* buffer) {
+    assert(event->type <= UINT8_MAX);
+    buffer[0] = event->type;
+
+    /* Zigzag encoding keeps small negative values short */
+    uint32_t value = ((uint32_t)event->value << 1) ^
+        (uint32_t)(event->value >> 31);
+
+    size_t length = 1;
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        buffer[length++] = value != 0 ? byte | 0x80 : byte;
+    } while (value != 0);
+
+    return length;
+}
+
+size_t protocol_encode_event(int version, const struct client_event* event,
+        uint8_t* buffer) {
+    if (version == PROTOCOL_V1) {
+        return encode_event_v1(event, buffer);
+    }
+
+    return encode_event_v2(event, buffer);
+}
+
+static ssize_t decode_event_v1(const uint8_t* buffer, size_t length,
+        struct client_event* event) {
+    if (length < EV_MSG_SIZE) {
+        return 0;
+    }
+
+    event->type = ntohs(EV_MSG_FIELD(buffer, type));
+    event->value = (int16_t)ntohs(EV_MSG_FIELD(buffer, value));
+    event->time = 0;
+
+    return EV_MSG_SIZE;
+}
+
+static ssize_t decode_event_v2(const uint8_t* buffer, size_t length,
+        struct client_event* event) {
+    uint32_t value = 0;
+    for (size_t i = 1; i < length; i++) {
+        if (i > PROTOCOL_V2_MAX_VARINT_SIZE) {
+            return -1;
+        }
+
+        value |= (uint32_t)(buffer[i] & 0x7f) << (7 * (i - 1));
+        if ((buffer[i] & 0x80) == 0) {
+            event->type = buffer[0];
+            event->value = (int32_t)((value >> 1) ^ -(value & 1));
+            event->time = 0;
+            return i + 1;
+        }
+    }
+
+    if (length > PROTOCOL_V2_MAX_VARINT_SIZE + 1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+ssize_t protocol_decode_event(int version, const uint8_t* buffer,
+        size_t length, struct client_event* event) {
+    if (version == PROTOCOL_V1) {
+        return decode_event_v1(buffer, length, event);
+    }
+
+    return decode_event_v2(buffer, length, event);
+}
+
+uint32_t protocol_timestamp(const struct timespec* time) {
+    return (uint32_t)time->tv_sec * 1000000 + time->tv_nsec / 1000;
+}
+
+size_t protocol_encode_datagram_header(const struct datagram_header* header,
+        uint8_t* buffer) {
+    uint32_t seq = htonl(header->seq);
+    uint32_t key_seq = htonl(header->key_seq);
+
+    memcpy(&buffer[0], &seq, sizeof(seq));
+    memcpy(&buffer[4], &key_seq, sizeof(key_seq));
+    buffer[8] = header->key_count;
+
+    return DATAGRAM_HEADER_SIZE;
+}
+
+ssize_t protocol_decode_datagram_header(const uint8_t* buffer, size_t length,
+        struct datagram_header* header) {
+    if (length < DATAGRAM_HEADER_SIZE) {
+        return -1;
+    }
+
+    uint32_t seq, key_seq;
+    memcpy(&seq, &buffer[0], sizeof(seq));
+    memcpy(&key_seq, &buffer[4], sizeof(key_seq));
+
+    header->seq = ntohl(seq);
+    header->key_seq = ntohl(key_seq);
+    header->key_count = buffer[8];
+
+    return DATAGRAM_HEADER_SIZE;
+}
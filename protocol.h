@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+struct client_event;
+
+/*
+ * Version 1 messages are a fixed 16 bit type and 16 bit value, both in network
+ * byte order.
+ *
+ * Version 2 messages are a single byte type, followed by the 32 bit value as a
+ * zigzag encoded varint, taking one to five bytes.
+ *
+ * Connections start out using version 1. A client wanting to use a later
+ * version sends EV_CAPABILITIES followed by EV_HELLO, carrying the
+ * capabilities it supports and the highest version it speaks. The server
+ * answers in kind with the capabilities both support and the version to use.
+ * The client acknowledges the answer by repeating EV_HELLO with that version,
+ * still using version 1, after which both switch to it. A client which
+ * doesn't get an answer in time keeps using version 1 without acknowledging,
+ * as the server may not know about handshakes, and the server then stays
+ * with version 1 as well.
+ */
+#define PROTOCOL_V1 1
+#define PROTOCOL_V2 2
+#define PROTOCOL_VERSION PROTOCOL_V2
+
+/* Peer understands EV_FRAME_BEGIN/EV_FRAME_END */
+#define PROTOCOL_CAP_FRAMES (1 << 0)
+/* Peer understands EV_RELEASE_ALL */
+#define PROTOCOL_CAP_RELEASE_ALL (1 << 1)
+/* Peer understands EV_TIMESTAMP, EV_PING and EV_PONG */
+#define PROTOCOL_CAP_TIMESTAMPS (1 << 2)
+/* Peer takes part in heartbeats, which needs PROTOCOL_CAP_TIMESTAMPS */
+#define PROTOCOL_CAP_HEARTBEAT (1 << 3)
+
+#define PROTOCOL_CAPABILITIES (PROTOCOL_CAP_FRAMES | \
+        PROTOCOL_CAP_RELEASE_ALL | PROTOCOL_CAP_TIMESTAMPS | \
+        PROTOCOL_CAP_HEARTBEAT)
+
+/*
+ * Timestamps are microseconds of the sender's CLOCK_MONOTONIC, modulo 2^32,
+ * and need version 2 to fit. With PROTOCOL_CAP_TIMESTAMPS, the client may
+ * precede an event with EV_TIMESTAMP, carrying the time the event was
+ * captured. Within a frame, the timestamp goes after EV_FRAME_BEGIN.
+ *
+ * To relate the two clocks, the server now and then sends EV_PING carrying
+ * its current time. The client answers right away with EV_TIMESTAMP carrying
+ * its own current time, followed by EV_PONG echoing the value pinged.
+ */
+
+/*
+ * With PROTOCOL_CAP_HEARTBEAT, the server pings at least every
+ * PROTOCOL_HEARTBEAT_INTERVAL_MS, and may give up on a client which hasn't
+ * sent anything, pongs included, for a while. The client may likewise give up
+ * on a server it hasn't heard from. Clients using the datagram transport send
+ * a datagram at least as often, even with nothing new in it.
+ */
+#define PROTOCOL_HEARTBEAT_INTERVAL_MS 100
+
+/* Time to wait for the server to answer a handshake */
+#define PROTOCOL_HANDSHAKE_TIMEOUT_MS 500
+
+#define PROTOCOL_V2_MAX_VARINT_SIZE 5
+
+/* Largest possible message in any version */
+#define PROTOCOL_MAX_MSG_SIZE (1 + PROTOCOL_V2_MAX_VARINT_SIZE)
+
+/*
+ * The datagram transport uses version 2 events, with each datagram starting
+ * with a header. The header is followed by key_count reliable events, numbered
+ * consecutively from key_seq, and then by unreliable events.
+ *
+ * Reliable events are repeated in every datagram until the server acknowledges
+ * them, by sending back a header carrying the key_seq it expects next. The
+ * unreliable section only carries EV_POINTER_X/EV_POINTER_Y, the motion
+ * accumulated over the whole session, so that losing a datagram doesn't lose
+ * any movement and stale datagrams can be ignored altogether.
+ */
+#define DATAGRAM_HEADER_SIZE 9
+#define DATAGRAM_MAX_SIZE 512
+#define DATAGRAM_MAX_RELIABLE_EVENTS 64
+
+struct datagram_header {
+    uint32_t seq;
+    uint32_t key_seq;
+    uint8_t key_count;
+};
+
+/* Serial number arithmetic, for sequence numbers which may wrap */
+#define SEQ_AFTER(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) > 0)
+
+/* Encodes an event into buffer, which must fit PROTOCOL_MAX_MSG_SIZE bytes.
+ * Values not representable in the given version are clamped. Returns the
+ * number of bytes written.
+ */
+size_t protocol_encode_event(int version, const struct client_event* event,
+        uint8_t* buffer);
+
+/* Decodes an event from the first length bytes of buffer. Returns the number
+ * of bytes consumed, 0 if buffer holds an incomplete message or -1 if the
+ * message is malformed.
+ */
+ssize_t protocol_decode_event(int version, const uint8_t* buffer,
+        size_t length, struct client_event* event);
+
+/* Returns time, taken from CLOCK_MONOTONIC, as a protocol timestamp */
+uint32_t protocol_timestamp(const struct timespec* time);
+
+/* Writes a datagram header to buffer, which must fit DATAGRAM_HEADER_SIZE
+ * bytes. Returns the number of bytes written.
+ */
+size_t protocol_encode_datagram_header(const struct datagram_header* header,
+        uint8_t* buffer);
+
+/* Reads a datagram header from the first length bytes of buffer. Returns the
+ * number of bytes consumed or -1 if the datagram is too short.
+ */
+ssize_t protocol_decode_datagram_header(const uint8_t* buffer, size_t length,
+        struct datagram_header* header);
+
+#endif /* _PROTOCOL_H_ */
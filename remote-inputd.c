@@ -16,70 +16,258 @@
  * You should have received a copy of the GNU General Public License
  * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <inttypes.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
 #include <syslog.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
 
+#include "clock_sync.h"
+#include "histogram.h"
 #include "input_device.h"
+#include "jitter_buffer.h"
 #include "logging.h"
+#include "protocol.h"
 #include "server.h"
 #include "shared.h"
+#include "socket_profile.h"
 #include "out/gen/keymap.h"
 
 #define INPUT_DEVICE_NAME "remote-input"
 
 #define DEFAULT_PORT_NUMBER 4004
 
+#define MAX_SHARDS 64
+
 #define UNPRIVILEGED_USER "nobody"
 
+/* Maximum number of simultaneously connected clients per shard */
+#define MAX_CLIENTS 16
+
+#define MAX_EPOLL_EVENTS 16
+
+/* Peers are given up on once silent for this long, which is at least two of
+ * the heartbeats datagram clients send */
+#define DEFAULT_PEER_TIMEOUT_MS 500
+#define MIN_PEER_TIMEOUT_MS (2 * PROTOCOL_HEARTBEAT_INTERVAL_MS)
+#define MAX_PEER_TIMEOUT_MS (60 * 1000)
+
+/* epoll user data identifying the source of an event */
+#define EVENT_SOURCE_STOP       0
+#define EVENT_SOURCE_SERVER     1
+#define EVENT_SOURCE_DATAGRAM   2
+#define EVENT_SOURCE_DUMP       3
+#define EVENT_SOURCE_PLAYOUT    4
+#define EVENT_SOURCE_HEARTBEAT  5
+#define EVENT_SOURCE_CLIENT(n)  (6 + (n))
+/* Devices are numbered by slot and role, see device_index() */
+#define EVENT_SOURCE_DEVICE(n)  (EVENT_SOURCE_CLIENT(MAX_CLIENTS) + (n))
+
+/* Number of datagrams received with each recvmmsg() */
+#define DATAGRAM_BATCH_SIZE 16
+
 #define FATAL_ERRNO(format) { \
         LOG_ERRNO(format); \
         exit(EXIT_FAILURE); \
     }
 
-/* Modified by signal handler, indicating that the main loop should exit */
-static volatile sig_atomic_t should_exit = false;
+/* Relative motion decoded from a single read, applied as one report */
+struct pending_motion {
+    int32_t dx;
+    int32_t dy;
+    int32_t wheel;
+    int32_t hwheel;
+};
+
+/* Classes of events, each with a device of its own when devices are split */
+enum device_role {
+    DEVICE_KEYBOARD,
+    DEVICE_POINTER,
+    DEVICE_WHEEL,
+    DEVICE_ROLES
+};
+
+struct device_slot {
+    /* Unless split, the keyboard device is used for everything. Devices
+     * which aren't set up have a negative uinput_fd */
+    struct input_device devices[DEVICE_ROLES];
+    bool split;
+    /* Set for devices with uinput_fd watched for writability */
+    bool output_watched[DEVICE_ROLES];
+    /* Number of clients and datagram peers using the device */
+    size_t users;
+    /* Number of users holding down each key */
+    uint8_t key_holders[KEY_MAX + 1];
+    /* User whose frame is open on the devices, if any */
+    struct device_user* frame_owner;
+};
+
+/* A client's or datagram peer's share of a device, which other users have
+ * their own of unless devices are pooled */
+struct device_user {
+    /* NULL while unused */
+    struct device_slot* slot;
+    struct pending_motion motion;
+    /* Keys this user holds down */
+    uint8_t pressed_keys[KEY_MAX / 8 + 1];
+};
 
 struct args {
     bool dont_daemonize;
     int verbosity;
     uint16_t local_port;
     char* local_host;
+    size_t shards;
+    size_t pool_size;
+    bool split_devices;
+    bool datagrams;
+    bool low_latency;
+    unsigned int capabilities;
+    /* In ms, 0 for the kernel's defaults */
+    int repeat_delay;
+    int repeat_period;
+    /* In ms, negative without a jitter buffer */
+    int jitter_delay;
+    /* In ms, 0 to never give up on peers */
+    int peer_timeout;
+    int dscp;
 };
 
 static const struct args argument_defaults = {
     .dont_daemonize = false,
     .verbosity = LOG_NOTICE,
     .local_port = DEFAULT_PORT_NUMBER,
-    .local_host = NULL
+    .local_host = NULL,
+    .shards = 1,
+    .pool_size = 0,
+    .split_devices = false,
+    .datagrams = false,
+    .low_latency = true,
+    .capabilities = DEVICE_PROFILE_FULL,
+    .repeat_delay = 0,
+    .repeat_period = 0,
+    .jitter_delay = -1,
+    .peer_timeout = DEFAULT_PEER_TIMEOUT_MS,
+    .dscp = DSCP_EF
 };
 
-static void sig_handler(int signum) {
-    switch (signum) {
-        case SIGINT:
-        case SIGTERM:
-            should_exit = true;
-            break;
+/* Where the time goes between a client's data arriving and it reaching
+ * uinput, see dump_latency() */
+struct latency_stats {
+    /* From the kernel receiving data until the daemon reads it */
+    struct histogram receive;
+    /* Decoding a single event */
+    struct histogram decode;
+    /* Handling a single decoded event */
+    struct histogram dispatch;
+    /* A single write to uinput */
+    struct histogram commit;
+    /* From the kernel receiving data until all of it has been handled */
+    struct histogram total;
+    /* Round trips of pings to clients */
+    struct histogram round_trip;
+};
+
+/*
+ * Each shard runs its own event loop in a separate thread, with a listening
+ * socket, input device and clients of its own. All shards listen on the same
+ * port using SO_REUSEPORT, letting the kernel spread connections between them,
+ * so nothing is shared between threads on the event path.
+ */
+struct event_loop {
+    size_t index;
+    pthread_t thread;
+
+    int epoll_fd;
+    /* Shared between all shards, becomes readable when it's time to exit */
+    int stop_fd;
+    /* Shared between all shards, written to by a shard exiting on an error */
+    int exited_fd;
+    /* Becomes readable when the latency statistics are to be logged */
+    int dump_fd;
+    /* Target delay of jitter buffers in ms, negative without them */
+    int jitter_delay;
+    /* Expires when the next event held in a jitter buffer is due */
+    int playout_fd;
+    /* Expires every heartbeat_interval ms, to ping clients and give up on
+     * those silent for longer than peer_timeout ms */
+    int heartbeat_fd;
+    int heartbeat_interval;
+    int peer_timeout;
+
+    struct latency_stats latency;
+
+    struct server_info server;
+
+    /* Devices created up front. With a device pool, every client gets a
+     * device of its own, otherwise all clients share the first one */
+    struct device_slot devices[MAX_CLIENTS];
+    size_t device_count;
+    bool pooled;
+
+    /* Unused slots have a negative cl_fd. Clients are paused, and not read
+     * from, while their device has fallen behind */
+    struct client_info clients[MAX_CLIENTS];
+    struct device_user client_devices[MAX_CLIENTS];
+    bool paused_clients[MAX_CLIENTS];
+    /* What each client's socket is watched for */
+    uint32_t client_watches[MAX_CLIENTS];
+    /* From clients capturing events until they were injected, for clients
+     * sending timestamps */
+    struct histogram capture_latency[MAX_CLIENTS];
+    /* Used for clients sending timestamps if playout_fd is set */
+    struct jitter_buffer jitter_buffers[MAX_CLIENTS];
+
+    /* Datagram transport, with a negative sv_fd if disabled */
+    struct server_info datagram_server;
+    bool datagrams_paused;
+    struct datagram_peer peers[MAX_CLIENTS];
+    struct device_user peer_devices[MAX_CLIENTS];
+    struct datagram datagrams[DATAGRAM_BATCH_SIZE];
+};
+
+static int create_signal_fd(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+
+    /* Handle termination through the event loop rather than asynchronously */
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        return -1;
     }
-}
 
-static int install_signal_handlers(void) {
-    static struct sigaction sa = {
-        .sa_handler = sig_handler
-    };
+    /* Writes to disconnected clients are handled where they happen */
+    signal(SIGPIPE, SIG_IGN);
 
-    sigemptyset(&sa.sa_mask);
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
+    return signalfd(-1, &mask, SFD_CLOEXEC);
+}
 
-    return 0;
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) {
+        return -1;
+    }
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
 static void daemonize(void) {
@@ -131,45 +319,1216 @@ static void drop_privileges(void) {
     }
 }
 
-static void handle_event(struct input_device* device,
-        struct client_event* event) {
+/* Returns the device for a class of events, or NULL if there is none */
+static struct input_device* slot_device(struct device_slot* slot,
+        enum device_role role) {
+    struct input_device* device = &slot->devices[slot->split ? role : 0];
+    return device->uinput_fd >= 0 ? device : NULL;
+}
+
+/* Reports the frame open on a slot's devices, with one sync for each device
+ * that has events queued */
+static void end_frame(struct device_slot* slot) {
+    for (size_t i = 0; i < DEVICE_ROLES; i++) {
+        if (slot->devices[i].uinput_fd >= 0) {
+            device_end_frame(&slot->devices[i]);
+        }
+    }
+    slot->frame_owner = NULL;
+}
+
+/* Keeps events of a user out of the frame another user of a shared device
+ * has open, reporting that frame early */
+static void claim_frame(struct device_user* user) {
+    struct device_slot* slot = user->slot;
+    if (slot->frame_owner != NULL && slot->frame_owner != user) {
+        end_frame(slot);
+    }
+}
+
+static void begin_frame(struct device_user* user) {
+    struct device_slot* slot = user->slot;
+    if (slot->frame_owner == user) {
+        return;
+    }
+
+    claim_frame(user);
+    for (size_t i = 0; i < DEVICE_ROLES; i++) {
+        if (slot->devices[i].uinput_fd >= 0) {
+            device_begin_frame(&slot->devices[i]);
+        }
+    }
+    slot->frame_owner = user;
+}
+
+static void flush_motion(struct device_user* user) {
+    struct input_device* pointer = slot_device(user->slot, DEVICE_POINTER);
+    struct input_device* wheel = slot_device(user->slot, DEVICE_WHEEL);
+    struct pending_motion motion = user->motion;
+    user->motion = (struct pending_motion) { 0 };
+
+    bool has_motion = pointer != NULL && (motion.dx != 0 || motion.dy != 0);
+    bool has_wheel = wheel != NULL && (motion.wheel != 0 || motion.hwheel != 0);
+    if (!has_motion && !has_wheel) {
+        return;
+    }
+
+    /* Report both in one go, which split devices do in a frame each. Inside
+     * the user's own frame, they are reported when it ends */
+    bool is_frame = has_motion && has_wheel &&
+        user->slot->frame_owner != user;
+    if (is_frame) {
+        begin_frame(user);
+    } else {
+        claim_frame(user);
+    }
+
+    if (has_motion) {
+        device_mouse_move(pointer, motion.dx, motion.dy);
+    }
+    if (has_wheel) {
+        device_mouse_wheel(wheel, motion.hwheel, motion.wheel);
+    }
+
+    if (is_frame) {
+        end_frame(user->slot);
+    }
+}
+
+static void handle_key(struct device_user* user, uint16_t keycode,
+        bool pressed) {
+    struct device_slot* slot = user->slot;
+    /* Mouse buttons belong with the motion on a pointer device */
+    bool is_button = keycode >= BTN_MOUSE && keycode < BTN_JOYSTICK;
+    struct input_device* device = slot_device(slot,
+            is_button ? DEVICE_POINTER : DEVICE_KEYBOARD);
+    if (device == NULL || keycode > KEY_MAX) {
+        return;
+    }
+
+    uint8_t* byte = &user->pressed_keys[keycode / 8];
+    uint8_t bit = 1 << (keycode % 8);
+    if (pressed == ((*byte & bit) != 0)) {
+        return;
+    }
+    *byte ^= bit;
+
+    /* A key of a shared device stays down while any user holds it */
+    claim_frame(user);
+    if (pressed) {
+        if (slot->key_holders[keycode]++ == 0) {
+            device_key_down(device, keycode);
+        }
+    } else if (--slot->key_holders[keycode] == 0) {
+        device_key_up(device, keycode);
+    }
+}
+
+/* Releases the keys held by a user, reported at once or with the rest of the
+ * user's open frame */
+static void release_all_keys(struct device_user* user) {
+    bool in_frame = user->slot->frame_owner == user;
+    if (!in_frame) {
+        begin_frame(user);
+    }
+
+    for (uint16_t key = 0; key <= KEY_MAX; key++) {
+        if (user->pressed_keys[key / 8] & (1 << (key % 8))) {
+            handle_key(user, key, false);
+        }
+    }
+
+    if (!in_frame) {
+        end_frame(user->slot);
+    }
+}
+
+/* Adds a motion or wheel event to the pending motion, returning false for other
+ * events */
+static bool sum_motion(struct pending_motion* motion,
+        const struct client_event* event) {
     switch (event->type) {
         case EV_MOUSE_DX:
-            device_mouse_move(device, event->value, 0);
-            break;
+            motion->dx += event->value;
+            return true;
         case EV_MOUSE_DY:
-            device_mouse_move(device, 0, event->value);
+            motion->dy += event->value;
+            return true;
+        case EV_WHEEL:
+            motion->wheel += event->value;
+            return true;
+        case EV_HWHEEL:
+            motion->hwheel += event->value;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Frame markers are passed on to the devices, so that everything in a frame is
+ * reported with a single sync. Motion and wheel events are summed up rather
+ * than applied right away, and reported at the end of their frame, or right
+ * after them outside of frames. While more input is already buffered behind
+ * them, though, the daemon has fallen behind, and motion is summed on across
+ * frames until the backlog is gone, being reported at once instead of step by
+ * step. Pending motion is applied before any other event, keeping it in order
+ * with key and button transitions.
+ */
+static void handle_event(struct device_user* user,
+        struct client_event* event, bool backlog) {
+    if (sum_motion(&user->motion, event)) {
+        if (!backlog && user->slot->frame_owner != user) {
+            flush_motion(user);
+        }
+        return;
+    }
+
+    switch (event->type) {
+        case EV_FRAME_BEGIN:
+            begin_frame(user);
+            return;
+        case EV_FRAME_END:
+            if (!backlog) {
+                flush_motion(user);
+            }
+            /* Unless another user's events ended the frame early */
+            if (user->slot->frame_owner == user) {
+                end_frame(user->slot);
+            }
+            return;
+        default:
             break;
+    }
+
+    flush_motion(user);
+
+    switch (event->type) {
         case EV_KEY_DOWN:
-            device_key_down(device, lookup_keycode(event->value));
+            handle_key(user, lookup_keycode(event->value), true);
             break;
         case EV_KEY_UP:
-            device_key_up(device, lookup_keycode(event->value));
+            handle_key(user, lookup_keycode(event->value), false);
             break;
-        case EV_WHEEL:
-            device_mouse_wheel(device, 0, event->value);
-            break;
-        case EV_HWHEEL:
-            device_mouse_wheel(device, event->value, 0);
+        case EV_RELEASE_ALL:
+            release_all_keys(user);
             break;
         default:
             LOG(ERROR, "unknown event type: %u", event->type);
     }
 }
 
-static void handle_client(struct client_info* client,
-        struct input_device* device) {
-    struct client_event event;
+static int watch_fd(struct event_loop* loop, int fd, uint64_t source) {
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.u64 = source
+    };
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        LOG_ERRNO("error watching fd %d", fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Stops or resumes reading from a watched fd */
+static void pause_fd(struct event_loop* loop, int fd, uint64_t source,
+        bool paused) {
+    struct epoll_event event = {
+        .events = paused ? 0 : EPOLLIN,
+        .data.u64 = source
+    };
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+        LOG_ERRNO("error %s fd %d", paused ? "pausing" : "resuming", fd);
+    }
+}
+
+/* Watches a client for input unless it's paused, and for room to send while
+ * messages for it are waiting */
+static void watch_client(struct event_loop* loop, size_t index) {
+    struct client_info* client = &loop->clients[index];
+    uint32_t watches = (loop->paused_clients[index] ? 0 : EPOLLIN) |
+        (client->cl_send_length > 0 ? EPOLLOUT : 0);
+    if (watches == loop->client_watches[index]) {
+        return;
+    }
+
+    struct epoll_event event = {
+        .events = watches,
+        .data.u64 = EVENT_SOURCE_CLIENT(index)
+    };
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, client->cl_fd, &event) < 0) {
+        LOG_ERRNO("error watching %s", client->cl_addr);
+        return;
+    }
+    loop->client_watches[index] = watches;
+}
 
-    while (read_client_event(client, &event) > 0) {
-        handle_event(device, &event);
+/* Set when events for a slot are to be held back until uinput catches up */
+static bool slot_congested(struct device_slot* slot) {
+    for (size_t i = 0; i < DEVICE_ROLES; i++) {
+        if (slot->devices[i].uinput_fd >= 0 &&
+                device_output_congested(&slot->devices[i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static size_t device_index(struct event_loop* loop, struct device_slot* slot,
+        enum device_role role) {
+    return (slot - loop->devices) * DEVICE_ROLES + role;
+}
+
+/* Gives a user a device, returning -1 if there is none left */
+static int acquire_device(struct event_loop* loop, struct device_user* user) {
+    for (size_t i = 0; i < loop->device_count; i++) {
+        struct device_slot* slot = &loop->devices[i];
+        if (!loop->pooled || slot->users == 0) {
+            slot->users++;
+            user->slot = slot;
+            user->motion = (struct pending_motion) { 0 };
+            memset(user->pressed_keys, 0, sizeof(user->pressed_keys));
+            return 0;
+        }
     }
 
-    device_release_all_keys(device);
+    return -1;
+}
+
+/* Releases the keys the user holds, leaving alone those which other users of
+ * a shared device hold, so that pooled devices are recycled with all keys
+ * up */
+static void release_device(struct device_user* user) {
+    flush_motion(user);
+    release_all_keys(user);
+    if (user->slot->frame_owner == user) {
+        end_frame(user->slot);
+    }
+
+    user->slot->users--;
+    user->slot = NULL;
+}
+
+static void dump_histogram(size_t shard, const char* stage,
+        const struct histogram* histogram) {
+    LOG(NOTICE, "shard %zu %-8s %8" PRIu64 " samples, p50 %7.1f us, "
+            "p90 %7.1f us, p99 %7.1f us, p99.9 %7.1f us, max %7.1f us",
+            shard, stage, histogram->total,
+            histogram_percentile(histogram, 50) / 1000.0,
+            histogram_percentile(histogram, 90) / 1000.0,
+            histogram_percentile(histogram, 99) / 1000.0,
+            histogram_percentile(histogram, 99.9) / 1000.0,
+            histogram->max / 1000.0);
+}
+
+static struct jitter_buffer* client_jitter_buffer(struct event_loop* loop,
+        const struct client_info* client) {
+    if (loop->playout_fd < 0 ||
+            !(client->cl_capabilities & PROTOCOL_CAP_TIMESTAMPS)) {
+        return NULL;
+    }
+
+    return &loop->jitter_buffers[client - loop->clients];
+}
+
+/* Logs the time from the client capturing events until they were injected,
+ * as far as the client has said */
+static void dump_capture_latency(struct event_loop* loop,
+        const struct client_info* client) {
+    const struct histogram* histogram =
+        &loop->capture_latency[client - loop->clients];
+    if (histogram->total == 0) {
+        return;
+    }
+
+    char stage[INET6_ADDRSTRLEN + 64];
+    snprintf(stage, sizeof(stage), "capture from %s (rtt %" PRIu32 " us)",
+            client->cl_addr, clock_sync_round_trip(&client->cl_clock));
+    dump_histogram(loop->index, stage, histogram);
+
+    const struct jitter_buffer* buffer = client_jitter_buffer(loop, client);
+    if (buffer != NULL) {
+        LOG(NOTICE, "shard %zu jitter buffer for %s: delay %.1f ms, "
+                "%" PRIu64 " events late, %" PRIu64 " played early",
+                loop->index, client->cl_addr, buffer->delay / 1000.0,
+                buffer->stats.late, buffer->stats.overflows);
+    }
+}
+
+static void close_client(struct event_loop* loop,
+        struct client_info* client) {
+    size_t index = client - loop->clients;
+    release_device(&loop->client_devices[index]);
+    loop->paused_clients[index] = false;
 
     LOG(NOTICE, "terminating connection from %s", client->cl_addr);
+    dump_capture_latency(loop, client);
 
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, client->cl_fd, NULL);
     close(client->cl_fd);
+    client->cl_fd = -1;
+}
+
+static bool has_timestamp(const struct timespec* timestamp) {
+    return timestamp->tv_sec != 0 || timestamp->tv_nsec != 0;
+}
+
+static void record_receive_latency(struct event_loop* loop,
+        const struct timespec* received) {
+    if (has_timestamp(received)) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        histogram_record(&loop->latency.receive, elapsed_ns(received, &now));
+    }
+}
+
+static void record_total_latency(struct event_loop* loop,
+        const struct timespec* received) {
+    if (has_timestamp(received)) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        histogram_record(&loop->latency.total, elapsed_ns(received, &now));
+    }
+}
+
+static void record_capture_latency(struct event_loop* loop,
+        const struct client_info* client, const struct client_event* event,
+        const struct timespec* injected) {
+    uint32_t captured;
+    if (event->time == 0 || clock_sync_to_local(&client->cl_clock,
+                event->time, &captured) < 0) {
+        return;
+    }
+
+    /* Clock estimates a little off can make it seem negative */
+    int32_t latency_us = protocol_timestamp(injected) - captured;
+    histogram_record(&loop->capture_latency[client - loop->clients],
+            latency_us > 0 ? latency_us * 1000ULL : 0);
+}
+
+static void play_event(struct event_loop* loop, struct client_info* client,
+        struct client_event* event, const struct timespec* now,
+        bool backlog) {
+    handle_event(&loop->client_devices[client - loop->clients], event,
+            backlog);
+    record_capture_latency(loop, client, event, now);
+}
+
+/* Holds an event back in the client's jitter buffer, making room by playing
+ * out the earliest event early if needed */
+static void buffer_event(struct event_loop* loop, struct client_info* client,
+        struct jitter_buffer* buffer, const struct client_event* event,
+        const struct timespec* now) {
+    while (!jitter_buffer_push(buffer, event, protocol_timestamp(now))) {
+        struct client_event early;
+        jitter_buffer_shift(buffer, &early);
+        buffer->stats.overflows++;
+        play_event(loop, client, &early, now, true);
+    }
+}
+
+/* Plays out the events of the client's jitter buffer which are due */
+static void play_buffered_events(struct event_loop* loop,
+        struct client_info* client, struct jitter_buffer* buffer) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint32_t timestamp = protocol_timestamp(&now);
+    struct client_event event;
+    while (jitter_buffer_pop(buffer, timestamp, &event)) {
+        /* Events which are overdue together are a backlog of their own */
+        uint32_t due;
+        bool backlog = jitter_buffer_next_due(buffer, &due) &&
+            (int32_t) (due - timestamp) <= 0;
+        play_event(loop, client, &event, &now, backlog);
+    }
+    flush_motion(&loop->client_devices[client - loop->clients]);
+}
+
+/* Arms the playout timer for the earliest event held in any jitter buffer */
+static void schedule_playout(struct event_loop* loop) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    bool pending = false;
+    int32_t wait_us = INT32_MAX;
+    for (size_t i = 0; i < MAX_CLIENTS; i++) {
+        uint32_t due;
+        if (loop->clients[i].cl_fd >= 0 &&
+                jitter_buffer_next_due(&loop->jitter_buffers[i], &due)) {
+            int32_t until_due = due - protocol_timestamp(&now);
+            wait_us = until_due < wait_us ? until_due : wait_us;
+            pending = true;
+        }
+    }
+
+    /* An all zero timer disarms it, so overdue events wait a nanosecond */
+    struct itimerspec timer = { 0 };
+    if (pending) {
+        wait_us = wait_us > 0 ? wait_us : 0;
+        timer.it_value.tv_sec = wait_us / 1000000;
+        timer.it_value.tv_nsec = wait_us % 1000000 * 1000 + 1;
+    }
+
+    if (timerfd_settime(loop->playout_fd, 0, &timer, NULL) < 0) {
+        LOG_ERRNO("error arming playout timer");
+    }
+}
+
+static void handle_playout(struct event_loop* loop) {
+    uint64_t expirations;
+    if (read(loop->playout_fd, &expirations, sizeof(expirations)) < 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < MAX_CLIENTS; i++) {
+        struct client_info* client = &loop->clients[i];
+        struct jitter_buffer* buffer = client_jitter_buffer(loop, client);
+        if (client->cl_fd >= 0 && buffer != NULL) {
+            play_buffered_events(loop, client, buffer);
+        }
+    }
+
+    schedule_playout(loop);
+}
+
+/* Decodes buffered events until there are none left or the client's device
+ * falls behind, returning -1 on malformed data. With a jitter buffer, events
+ * are held back there instead of being handled right away.
+ */
+static int decode_client_events(struct event_loop* loop,
+        struct client_info* client) {
+    struct device_user* user = &loop->client_devices[client - loop->clients];
+
+    struct client_event event;
+    int res = 0;
+    struct timespec start, decoded, handled;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!slot_congested(user->slot) &&
+            (res = next_client_event(client, &event)) > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &decoded);
+        /* Looked up for each event, as the handshake may enable timestamps */
+        struct jitter_buffer* buffer = client_jitter_buffer(loop, client);
+        if (buffer != NULL) {
+            buffer_event(loop, client, buffer, &event, &decoded);
+        } else {
+            handle_event(user, &event,
+                    client->cl_buffer_start < client->cl_buffer_end);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &handled);
+
+        histogram_record(&loop->latency.decode, elapsed_ns(&start, &decoded));
+        histogram_record(&loop->latency.dispatch,
+                elapsed_ns(&decoded, &handled));
+        if (buffer == NULL) {
+            record_capture_latency(loop, client, &event, &handled);
+        }
+        start = handled;
+    }
+    flush_motion(user);
+
+    /* Events arriving late are played out right away */
+    struct jitter_buffer* buffer = client_jitter_buffer(loop, client);
+    if (buffer != NULL) {
+        play_buffered_events(loop, client, buffer);
+        schedule_playout(loop);
+    }
+
+    return res < 0 ? -1 : 0;
+}
+
+static void handle_client(struct event_loop* loop,
+        struct client_info* client, uint32_t events) {
+    size_t index = client - loop->clients;
+    if ((events & EPOLLOUT) && flush_client(client) < 0) {
+        close_client(loop, client);
+        return;
+    }
+
+    /* Only writable, possibly while paused */
+    if (!(events & ~EPOLLOUT)) {
+        watch_client(loop, index);
+        return;
+    }
+
+    ssize_t read_length = receive_client_data(client);
+    if (read_length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+
+    /* The timestamp goes with the client, which may be closed below */
+    struct timespec received = client->cl_received;
+    record_receive_latency(loop, &received);
+
+    int res = decode_client_events(loop, client);
+    record_total_latency(loop, &received);
+
+    if (res < 0 || read_length <= 0) {
+        close_client(loop, client);
+        return;
+    }
+
+    /* Leave the rest in the receive buffer and the socket until uinput has
+     * caught up, pushing back on the client instead of dropping events */
+    if (slot_congested(loop->client_devices[index].slot)) {
+        loop->paused_clients[index] = true;
+    }
+    /* Also picks up a handshake answer the socket didn't take */
+    watch_client(loop, index);
+}
+
+static void accept_client(struct event_loop* loop) {
+    struct client_info* client = NULL;
+    for (size_t i = 0; i < MAX_CLIENTS; i++) {
+        if (loop->clients[i].cl_fd < 0) {
+            client = &loop->clients[i];
+            break;
+        }
+    }
+
+    struct client_info new_client;
+    struct client_info* accepted = client != NULL ? client : &new_client;
+    if (server_accept(&loop->server, accepted) < 0) {
+        return;
+    }
+
+    if (client == NULL) {
+        LOG(WARNING, "rejecting connection from %s, too many clients",
+                accepted->cl_addr);
+        close(accepted->cl_fd);
+        return;
+    }
+
+    struct device_user* user = &loop->client_devices[client - loop->clients];
+    if (acquire_device(loop, user) < 0) {
+        LOG(WARNING, "rejecting connection from %s, no free device",
+                client->cl_addr);
+        close(client->cl_fd);
+        client->cl_fd = -1;
+        return;
+    }
+
+    if (set_nonblocking(client->cl_fd) < 0 ||
+            watch_fd(loop, client->cl_fd,
+                EVENT_SOURCE_CLIENT(client - loop->clients)) < 0) {
+        LOG_ERRNO("error setting up connection from %s", client->cl_addr);
+        release_device(user);
+        close(client->cl_fd);
+        client->cl_fd = -1;
+        return;
+    }
+
+    loop->client_watches[client - loop->clients] = EPOLLIN;
+    histogram_init(&loop->capture_latency[client - loop->clients]);
+    client->cl_round_trips = &loop->latency.round_trip;
+    if (loop->jitter_delay >= 0) {
+        jitter_buffer_init(&loop->jitter_buffers[client - loop->clients],
+                loop->jitter_delay * 1000);
+    }
+
+    LOG(NOTICE, "accepted connection from %s (shard %zu)", client->cl_addr,
+            loop->index);
+}
+
+static struct datagram_peer* find_datagram_peer(struct event_loop* loop,
+        const struct datagram* datagram) {
+    struct datagram_peer* free_peer = NULL;
+    for (size_t i = 0; i < MAX_CLIENTS; i++) {
+        struct datagram_peer* peer = &loop->peers[i];
+        if (!peer->dp_active) {
+            free_peer = free_peer != NULL ? free_peer : peer;
+        } else if (datagram_from_peer(datagram, peer)) {
+            return peer;
+        }
+    }
+
+    if (free_peer == NULL) {
+        return NULL;
+    }
+
+    struct device_user* user = &loop->peer_devices[free_peer - loop->peers];
+    if (acquire_device(loop, user) < 0) {
+        return NULL;
+    }
+
+    datagram_peer_init(free_peer, datagram);
+    LOG(NOTICE, "new datagram session from %s (shard %zu)",
+            free_peer->dp_addr, loop->index);
+
+    return free_peer;
+}
+
+static void close_datagram_peer(struct event_loop* loop,
+        struct datagram_peer* peer) {
+    size_t index = peer - loop->peers;
+    release_device(&loop->peer_devices[index]);
+
+    LOG(NOTICE, "terminating datagram session from %s", peer->dp_addr);
+
+    peer->dp_active = false;
+}
+
+/* With a backlog, more datagrams are waiting behind this one */
+static void handle_datagram(struct event_loop* loop,
+        const struct datagram* datagram, bool backlog) {
+    struct datagram_peer* peer = find_datagram_peer(loop, datagram);
+    if (peer == NULL) {
+        LOG(WARNING, "ignoring datagram, too many clients or no free device");
+        return;
+    }
+
+    struct timespec start, decoded;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct client_event events[DATAGRAM_MAX_EVENTS];
+    ssize_t event_count = decode_datagram(peer, datagram, events);
+
+    clock_gettime(CLOCK_MONOTONIC, &decoded);
+    histogram_record(&loop->latency.decode, elapsed_ns(&start, &decoded));
+
+    if (event_count < 0) {
+        close_datagram_peer(loop, peer);
+        return;
+    }
+
+    acknowledge_datagrams(&loop->datagram_server, peer);
+
+    struct device_user* user = &loop->peer_devices[peer - loop->peers];
+    for (ssize_t i = 0; i < event_count; i++) {
+        if (events[i].type == EV_DISCONNECT) {
+            close_datagram_peer(loop, peer);
+            return;
+        }
+
+        handle_event(user, &events[i], backlog);
+    }
+}
+
+static bool silent_for(const struct timespec* last_heard, int timeout_ms) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return elapsed_ns(last_heard, &now) / 1000000 >= (uint64_t) timeout_ms;
+}
+
+/* Pings clients, and ends the session of peers which have gone silent, so that
+ * the keys they hold are released */
+static void handle_heartbeat(struct event_loop* loop) {
+    uint64_t expirations;
+    if (read(loop->heartbeat_fd, &expirations, sizeof(expirations)) < 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < MAX_CLIENTS; i++) {
+        struct client_info* client = &loop->clients[i];
+        if (client->cl_fd < 0) {
+            continue;
+        }
+
+        /* Only clients taking part in heartbeats have to say something, and
+         * paused clients aren't read from. The kernel notices others going
+         * away through keepalive probes */
+        if (loop->peer_timeout > 0 &&
+                (client->cl_capabilities & PROTOCOL_CAP_HEARTBEAT) &&
+                !loop->paused_clients[i] &&
+                silent_for(&client->cl_last_heard, loop->peer_timeout)) {
+            LOG(WARNING, "no heartbeat from %s for %d ms", client->cl_addr,
+                    loop->peer_timeout);
+            close_client(loop, client);
+        } else if (ping_client(client) < 0) {
+            close_client(loop, client);
+        } else {
+            /* A client slow to read only has its pings skipped, with what the
+             * socket didn't take sent once it has room */
+            watch_client(loop, i);
+        }
+    }
+
+    for (size_t i = 0; i < MAX_CLIENTS; i++) {
+        struct datagram_peer* peer = &loop->peers[i];
+        if (loop->peer_timeout > 0 && peer->dp_active &&
+                silent_for(&peer->dp_last_heard, loop->peer_timeout)) {
+            LOG(WARNING, "no datagrams from %s for %d ms", peer->dp_addr,
+                    loop->peer_timeout);
+            close_datagram_peer(loop, peer);
+        }
+    }
+}
+
+static void handle_datagrams(struct event_loop* loop) {
+    int received = receive_datagrams(&loop->datagram_server, loop->datagrams,
+            DATAGRAM_BATCH_SIZE);
+
+    for (int i = 0; i < received; i++) {
+        record_receive_latency(loop, &loop->datagrams[i].dg_received);
+        handle_datagram(loop, &loop->datagrams[i], i + 1 < received);
+    }
+
+    for (size_t i = 0; i < MAX_CLIENTS; i++) {
+        if (loop->peers[i].dp_active) {
+            flush_motion(&loop->peer_devices[i]);
+        }
+    }
+
+    bool congested = false;
+    for (size_t i = 0; i < loop->device_count; i++) {
+        congested |= slot_congested(&loop->devices[i]);
+    }
+
+    for (int i = 0; i < received; i++) {
+        record_total_latency(loop, &loop->datagrams[i].dg_received);
+    }
+
+    /* The socket is shared by all peers, so any device falling behind holds
+     * back all of them */
+    if (congested) {
+        loop->datagrams_paused = true;
+        pause_fd(loop, loop->datagram_server.sv_fd, EVENT_SOURCE_DATAGRAM,
+                true);
+    }
+}
+
+/* Watches devices with events waiting for uinput for writability, and stops
+ * watching those which have caught up */
+static void update_output_watches(struct event_loop* loop) {
+    for (size_t i = 0; i < loop->device_count; i++) {
+        struct device_slot* slot = &loop->devices[i];
+        for (size_t j = 0; j < DEVICE_ROLES; j++) {
+            struct input_device* device = &slot->devices[j];
+            bool pending = device->uinput_fd >= 0 &&
+                device_output_pending(device);
+            if (pending == slot->output_watched[j]) {
+                continue;
+            }
+
+            struct epoll_event event = {
+                .events = EPOLLOUT,
+                .data.u64 = EVENT_SOURCE_DEVICE(device_index(loop, slot, j))
+            };
+            if (epoll_ctl(loop->epoll_fd,
+                        pending ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                        device->uinput_fd, &event) < 0) {
+                LOG_ERRNO("error watching %s", device->name);
+                continue;
+            }
+            slot->output_watched[j] = pending;
+        }
+    }
+}
+
+/* Resumes clients paused while their device was falling behind */
+static void resume_paused(struct event_loop* loop) {
+    for (size_t i = 0; i < MAX_CLIENTS; i++) {
+        struct client_info* client = &loop->clients[i];
+        if (!loop->paused_clients[i] ||
+                slot_congested(loop->client_devices[i].slot)) {
+            continue;
+        }
+
+        /* Events left in the receive buffer go first */
+        if (decode_client_events(loop, client) < 0) {
+            close_client(loop, client);
+        } else if (!slot_congested(loop->client_devices[i].slot)) {
+            loop->paused_clients[i] = false;
+            watch_client(loop, i);
+        }
+    }
+
+    if (loop->datagrams_paused) {
+        bool congested = false;
+        for (size_t i = 0; i < loop->device_count; i++) {
+            congested |= slot_congested(&loop->devices[i]);
+        }
+
+        if (!congested) {
+            loop->datagrams_paused = false;
+            pause_fd(loop, loop->datagram_server.sv_fd, EVENT_SOURCE_DATAGRAM,
+                    false);
+        }
+    }
+}
+
+static void dump_latency(struct event_loop* loop) {
+    uint64_t requests;
+    if (read(loop->dump_fd, &requests, sizeof(requests)) < 0) {
+        return;
+    }
+
+    dump_histogram(loop->index, "receive", &loop->latency.receive);
+    dump_histogram(loop->index, "decode", &loop->latency.decode);
+    dump_histogram(loop->index, "dispatch", &loop->latency.dispatch);
+    dump_histogram(loop->index, "commit", &loop->latency.commit);
+    dump_histogram(loop->index, "total", &loop->latency.total);
+    dump_histogram(loop->index, "rtt", &loop->latency.round_trip);
+
+    for (size_t i = 0; i < MAX_CLIENTS; i++) {
+        if (loop->clients[i].cl_fd >= 0) {
+            dump_capture_latency(loop, &loop->clients[i]);
+        }
+    }
+}
+
+static void* run_event_loop(void* arg) {
+    struct event_loop* loop = arg;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+
+    bool running = true;
+    while (running) {
+        int event_count = epoll_wait(loop->epoll_fd, events, MAX_EPOLL_EVENTS,
+                -1);
+        if (event_count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            LOG_ERRNO("epoll_wait error");
+
+            /* Have the daemon stop, rather than keep a listening socket
+             * nobody accepts connections from */
+            uint64_t exited = 1;
+            if (write(loop->exited_fd, &exited, sizeof(exited)) < 0) {
+                LOG_ERRNO("couldn't report shard %zu exiting", loop->index);
+            }
+            break;
+        }
+
+        for (int i = 0; i < event_count; i++) {
+            uint64_t source = events[i].data.u64;
+            if (source == EVENT_SOURCE_STOP) {
+                running = false;
+            } else if (source == EVENT_SOURCE_SERVER) {
+                accept_client(loop);
+            } else if (source == EVENT_SOURCE_DATAGRAM) {
+                handle_datagrams(loop);
+            } else if (source == EVENT_SOURCE_DUMP) {
+                dump_latency(loop);
+            } else if (source == EVENT_SOURCE_PLAYOUT) {
+                handle_playout(loop);
+            } else if (source == EVENT_SOURCE_HEARTBEAT) {
+                handle_heartbeat(loop);
+            } else if (source >= EVENT_SOURCE_DEVICE(0)) {
+                size_t index = source - EVENT_SOURCE_DEVICE(0);
+                struct device_slot* slot = &loop->devices[index / DEVICE_ROLES];
+                device_flush_output(&slot->devices[index % DEVICE_ROLES]);
+            } else {
+                struct client_info* client =
+                    &loop->clients[source - EVENT_SOURCE_CLIENT(0)];
+                if (client->cl_fd >= 0) {
+                    handle_client(loop, client, events[i].events);
+                }
+            }
+        }
+
+        update_output_watches(loop);
+        resume_paused(loop);
+    }
+
+    for (size_t i = 0; i < MAX_CLIENTS; i++) {
+        if (loop->clients[i].cl_fd >= 0) {
+            close_client(loop, &loop->clients[i]);
+        }
+
+        if (loop->peers[i].dp_active) {
+            close_datagram_peer(loop, &loop->peers[i]);
+        }
+    }
+
+    return NULL;
+}
+
+static void close_devices(struct event_loop* loop) {
+    for (size_t i = 0; i < loop->device_count; i++) {
+        for (size_t j = 0; j < DEVICE_ROLES; j++) {
+            struct input_device* device = &loop->devices[i].devices[j];
+            if (device->uinput_fd >= 0) {
+                device_close(device);
+            }
+        }
+    }
+    loop->device_count = 0;
+}
+
+static const struct {
+    const char* suffix;
+    unsigned int capabilities;
+} split_devices[DEVICE_ROLES] = {
+    [DEVICE_KEYBOARD] = { "-keyboard",
+        DEVICE_CAP_KEYBOARD | DEVICE_CAP_EXTRA | DEVICE_CAP_REPEAT },
+    [DEVICE_POINTER] = { "-pointer", DEVICE_CAP_BUTTONS | DEVICE_CAP_MOTION },
+    [DEVICE_WHEEL] = { "-wheel", DEVICE_CAP_WHEEL },
+};
+
+/* Split devices advertise a single class of events each, and are set up but
+ * not created until their first event, so that unused ones never appear */
+static int prepare_split_devices(struct device_slot* slot,
+        const char* device_name, unsigned int capabilities) {
+    for (size_t i = 0; i < DEVICE_ROLES; i++) {
+        unsigned int role_capabilities =
+            capabilities & split_devices[i].capabilities;
+        if (role_capabilities == 0) {
+            continue;
+        }
+
+        char role_name[UINPUT_MAX_NAME_SIZE];
+        snprintf(role_name, sizeof(role_name), "%s%s", device_name,
+                split_devices[i].suffix);
+        if (device_prepare(role_name, role_capabilities,
+                    &slot->devices[i]) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Sets up all devices of the shard before any client connects, so that
+ * connecting never waits for a device to be set up */
+static int create_devices(struct event_loop* loop, size_t count,
+        const struct args* args) {
+    unsigned int capabilities = args->capabilities;
+    bool split = args->split_devices;
+
+    char device_name[sizeof(INPUT_DEVICE_NAME "-.") + 40];
+    for (size_t i = 0; i < count; i++) {
+        int length = snprintf(device_name, sizeof(device_name),
+                INPUT_DEVICE_NAME);
+        if (loop->index > 0) {
+            length += snprintf(&device_name[length],
+                    sizeof(device_name) - length, "-%zu", loop->index);
+        }
+        if (loop->pooled) {
+            snprintf(&device_name[length], sizeof(device_name) - length,
+                    ".%zu", i);
+        }
+
+        struct device_slot* slot = &loop->devices[i];
+        for (size_t j = 0; j < DEVICE_ROLES; j++) {
+            slot->devices[j].uinput_fd = -1;
+        }
+        slot->split = split;
+        for (size_t j = 0; j < DEVICE_ROLES; j++) {
+            slot->output_watched[j] = false;
+        }
+        slot->users = 0;
+        memset(slot->key_holders, 0, sizeof(slot->key_holders));
+        slot->frame_owner = NULL;
+        loop->device_count++;
+
+        int res = split ?
+            prepare_split_devices(slot, device_name, capabilities) :
+            device_create(device_name, capabilities, &slot->devices[0]);
+        if (res < 0) {
+            LOG(FATAL, "couldn't create input device");
+            close_devices(loop);
+            return -1;
+        }
+
+        for (size_t j = 0; j < DEVICE_ROLES; j++) {
+            struct input_device* device = &slot->devices[j];
+            if (device->uinput_fd < 0) {
+                continue;
+            }
+
+            device->commit_latency = &loop->latency.commit;
+            if (args->repeat_delay > 0 || args->repeat_period > 0) {
+                device_set_repeat(device, args->repeat_delay,
+                        args->repeat_period);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int event_loop_init(struct event_loop* loop, size_t index,
+        const struct args* args) {
+    loop->index = index;
+    loop->epoll_fd = -1;
+    loop->dump_fd = -1;
+    loop->jitter_delay = args->jitter_delay;
+    loop->playout_fd = -1;
+    loop->heartbeat_fd = -1;
+    loop->peer_timeout = args->peer_timeout;
+    /* Checking often enough to notice silence soon after the timeout */
+    loop->heartbeat_interval = PROTOCOL_HEARTBEAT_INTERVAL_MS;
+    if (loop->peer_timeout > 0 &&
+            loop->peer_timeout / 4 < loop->heartbeat_interval) {
+        loop->heartbeat_interval = loop->peer_timeout / 4;
+    }
+
+    loop->datagram_server.sv_fd = -1;
+    loop->datagrams_paused = false;
+
+    histogram_init(&loop->latency.receive);
+    histogram_init(&loop->latency.decode);
+    histogram_init(&loop->latency.dispatch);
+    histogram_init(&loop->latency.commit);
+    histogram_init(&loop->latency.total);
+    histogram_init(&loop->latency.round_trip);
+
+    for (size_t i = 0; i < MAX_CLIENTS; i++) {
+        loop->clients[i].cl_fd = -1;
+        loop->client_devices[i].slot = NULL;
+        loop->paused_clients[i] = false;
+        loop->peers[i].dp_active = false;
+        loop->peer_devices[i].slot = NULL;
+    }
+
+    loop->pooled = args->pool_size > 0;
+    loop->device_count = 0;
+    if (create_devices(loop, loop->pooled ? args->pool_size : 1, args) < 0) {
+        return -1;
+    }
+
+    struct socket_profile profile = { 0 };
+    if (args->low_latency) {
+        profile = socket_profile_low_latency;
+        profile.dscp = args->dscp;
+    }
+    profile.peer_timeout = args->peer_timeout;
+
+    if (server_create(args->local_host, args->local_port, args->shards > 1,
+                &profile, &loop->server) < 0) {
+        goto error;
+    }
+
+    if (set_nonblocking(loop->server.sv_fd) < 0) {
+        LOG_ERRNO("couldn't make server socket non-blocking");
+        goto error_server;
+    }
+
+    if (args->datagrams && server_create_datagram(args->local_host,
+                args->local_port, args->shards > 1, &profile,
+                &loop->datagram_server) < 0) {
+        goto error_server;
+    }
+
+    return 0;
+
+error_server:
+    server_close(&loop->server);
+error:
+    close_devices(loop);
+    return -1;
+}
+
+static int event_loop_start(struct event_loop* loop, int stop_fd,
+        int exited_fd) {
+    loop->stop_fd = stop_fd;
+    loop->exited_fd = exited_fd;
+
+    if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        LOG_ERRNO("epoll_create1 error");
+        return -1;
+    }
+
+    if ((loop->dump_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        LOG_ERRNO("couldn't create eventfd");
+        return -1;
+    }
+
+    if (loop->jitter_delay >= 0 && (loop->playout_fd = timerfd_create(
+                    CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK)) < 0) {
+        LOG_ERRNO("couldn't create timerfd");
+        return -1;
+    }
+
+    if (loop->playout_fd >= 0 &&
+            watch_fd(loop, loop->playout_fd, EVENT_SOURCE_PLAYOUT) < 0) {
+        return -1;
+    }
+
+    struct itimerspec heartbeat = {
+        .it_interval.tv_nsec = loop->heartbeat_interval * 1000000L,
+        .it_value.tv_nsec = loop->heartbeat_interval * 1000000L
+    };
+    if ((loop->heartbeat_fd = timerfd_create(CLOCK_MONOTONIC,
+                    TFD_CLOEXEC | TFD_NONBLOCK)) < 0 ||
+            timerfd_settime(loop->heartbeat_fd, 0, &heartbeat, NULL) < 0) {
+        LOG_ERRNO("couldn't set up heartbeat timer");
+        return -1;
+    }
+
+    if (watch_fd(loop, loop->heartbeat_fd, EVENT_SOURCE_HEARTBEAT) < 0) {
+        return -1;
+    }
+
+    if (watch_fd(loop, loop->stop_fd, EVENT_SOURCE_STOP) < 0 ||
+            watch_fd(loop, loop->dump_fd, EVENT_SOURCE_DUMP) < 0 ||
+            watch_fd(loop, loop->server.sv_fd, EVENT_SOURCE_SERVER) < 0) {
+        return -1;
+    }
+
+    if (loop->datagram_server.sv_fd >= 0 && watch_fd(loop,
+                loop->datagram_server.sv_fd, EVENT_SOURCE_DATAGRAM) < 0) {
+        return -1;
+    }
+
+    int res = pthread_create(&loop->thread, NULL, run_event_loop, loop);
+    if (res != 0) {
+        errno = res;
+        LOG_ERRNO("couldn't start shard %zu", loop->index);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void event_loop_close(struct event_loop* loop) {
+    if (loop->epoll_fd >= 0) {
+        close(loop->epoll_fd);
+    }
+    if (loop->dump_fd >= 0) {
+        close(loop->dump_fd);
+    }
+    if (loop->playout_fd >= 0) {
+        close(loop->playout_fd);
+    }
+    if (loop->heartbeat_fd >= 0) {
+        close(loop->heartbeat_fd);
+    }
+
+    server_close(&loop->server);
+    if (loop->datagram_server.sv_fd >= 0) {
+        server_close(&loop->datagram_server);
+    }
+    close_devices(loop);
+}
+
+/* Returns the signal received, or -1 on errors and once a shard has exited */
+static int wait_for_signal(int signal_fd, int exited_fd) {
+    struct pollfd pfds[] = {
+        { .fd = signal_fd, .events = POLLIN },
+        { .fd = exited_fd, .events = POLLIN }
+    };
+    int res;
+    do {
+        res = poll(pfds, 2, -1);
+    } while (res < 0 && errno == EINTR);
+
+    if (res < 0) {
+        LOG_ERRNO("error waiting for signals");
+        return -1;
+    }
+
+    if (pfds[1].revents) {
+        LOG(ERROR, "a shard has exited, stopping");
+        return -1;
+    }
+
+    struct signalfd_siginfo siginfo;
+    if (read(signal_fd, &siginfo, sizeof(siginfo)) < 0) {
+        LOG_ERRNO("error waiting for signals");
+        return -1;
+    }
+
+    LOG(INFO, "received signal %u", siginfo.ssi_signo);
+    return siginfo.ssi_signo;
 }
 
 static void usage(const char* program_name) {
@@ -179,9 +1538,48 @@ static void usage(const char* program_name) {
             "  -l hostname/ip   hostname or ip on which to listen on\n"
             "  -p port_number   "
                 "specify which port to bind to (defaults to %u)\n"
+            "  -u  --udp        "
+                "also accept clients using the datagram transport\n"
+            "  -j  --shards N   "
+                "serve clients from N threads, each with its own device\n"
+            "  -n  --devices N  "
+                "give each client a device of its own from a pool of N\n"
+            "                   "
+                "per shard, rejecting clients when none is left\n"
+            "  -c  --capabilities PROFILE\n"
+            "                   "
+                "register keyboard, mouse or full (default) capabilities,\n"
+            "                   "
+                "or a list of keys, buttons, motion, wheel and extra\n"
+            "  -s  --split      "
+                "use separate keyboard, pointer and wheel devices, each\n"
+            "                   created on its first event\n"
+            "  -J  --jitter-buffer MS\n"
+            "                   "
+                "replay events from clients sending timestamps with the\n"
+            "                   "
+                "spacing they were captured with, delayed by at least MS\n"
+            "                   "
+                "and more as jitter requires\n"
+            "  -t  --peer-timeout MS\n"
+            "                   "
+                "release the keys of clients and end their session once\n"
+            "                   "
+                "nothing was heard from them for MS (defaults to %u, 0 for\n"
+            "                   never)\n"
+            "  -r  --repeat DELAY[,PERIOD]\n"
+            "                   "
+                "repeat held keys after DELAY ms every PERIOD ms, or never\n"
+            "                   "
+                "with a DELAY of 0 (defaults to the kernel's settings)\n"
+            "  -D  --dscp N     "
+                "DSCP class to mark traffic with (defaults to %u, 0 for\n"
+            "                   none)\n"
+            "  -N  --no-low-latency\n"
+            "                   leave socket options at the system defaults\n"
             "  -v  --verbose    increase verbosity/logging level\n"
             "  -h  --help       show this help text and exit\n"
-            , DEFAULT_PORT_NUMBER);
+            , DEFAULT_PORT_NUMBER, DEFAULT_PEER_TIMEOUT_MS, DSCP_EF);
 }
 
 static struct args parse_args(int argc, char* argv[]) {
@@ -190,11 +1588,22 @@ static struct args parse_args(int argc, char* argv[]) {
     struct option const long_options[] = {
         {"help", no_argument, NULL, 'h'},
         {"verbose", no_argument, NULL, 'v'},
+        {"shards", required_argument, NULL, 'j'},
+        {"devices", required_argument, NULL, 'n'},
+        {"udp", no_argument, NULL, 'u'},
+        {"split", no_argument, NULL, 's'},
+        {"repeat", required_argument, NULL, 'r'},
+        {"jitter-buffer", required_argument, NULL, 'J'},
+        {"peer-timeout", required_argument, NULL, 't'},
+        {"capabilities", required_argument, NULL, 'c'},
+        {"dscp", required_argument, NULL, 'D'},
+        {"no-low-latency", no_argument, NULL, 'N'},
         {NULL, 0, NULL, 0}
     };
 
     int ch;
-    while ((ch = getopt_long(argc, argv, "dvhl:p:", long_options, NULL)) > 0) {
+    while ((ch = getopt_long(argc, argv, "dvhusNc:j:n:l:p:r:t:D:J:",
+                    long_options, NULL)) > 0) {
         switch (ch) {
             case 'd':
                 args.dont_daemonize = true;
@@ -207,6 +1616,90 @@ static struct args parse_args(int argc, char* argv[]) {
             case 'l':
                 args.local_host = optarg;
                 break;
+            case 'u':
+                args.datagrams = true;
+                break;
+            case 's':
+                args.split_devices = true;
+                break;
+            case 'N':
+                args.low_latency = false;
+                break;
+            case 'r':
+                {
+                    char* end;
+                    long delay = strtol(optarg, &end, 10);
+                    long period = *end == ',' ? strtol(end + 1, &end, 10) : 0;
+                    if (*end != '\0' || delay < 0 || delay > INT16_MAX ||
+                            period < 0 || period > INT16_MAX) {
+                        LOG(ERROR, "bad key repeat rate: %s", optarg);
+                        exit(EXIT_FAILURE);
+                    }
+                    args.repeat_delay = delay == 0 ? -1 : (int) delay;
+                    args.repeat_period = (int) period;
+                }
+                break;
+            case 'J':
+                {
+                    char* end;
+                    long delay = strtol(optarg, &end, 10);
+                    if (*end != '\0' || delay < 0 ||
+                            delay > JITTER_BUFFER_MAX_DELAY_MS) {
+                        LOG(ERROR, "bad jitter buffer delay: %s", optarg);
+                        exit(EXIT_FAILURE);
+                    }
+                    args.jitter_delay = (int) delay;
+                }
+                break;
+            case 't':
+                {
+                    char* end;
+                    long timeout = strtol(optarg, &end, 10);
+                    if (*end != '\0' || (timeout != 0 &&
+                                (timeout < MIN_PEER_TIMEOUT_MS ||
+                                 timeout > MAX_PEER_TIMEOUT_MS))) {
+                        LOG(ERROR, "bad peer timeout: %s", optarg);
+                        exit(EXIT_FAILURE);
+                    }
+                    args.peer_timeout = (int) timeout;
+                }
+                break;
+            case 'c':
+                if (device_parse_profile(optarg, &args.capabilities) < 0) {
+                    LOG(ERROR, "bad capability profile: %s", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'D':
+                {
+                    int dscp = strtol(optarg, NULL, 10);
+                    if (dscp < 0 || dscp > DSCP_MAX) {
+                        LOG(ERROR, "bad DSCP class: %s", optarg);
+                        exit(EXIT_FAILURE);
+                    }
+                    args.dscp = dscp;
+                }
+                break;
+            case 'j':
+                {
+                    int shards = strtol(optarg, NULL, 10);
+                    if (shards < 1 || shards > MAX_SHARDS) {
+                        LOG(ERROR, "bad number of shards: %s", optarg);
+                        exit(EXIT_FAILURE);
+                    }
+                    args.shards = (size_t) shards;
+                }
+                break;
+            case 'n':
+                {
+                    int pool_size = strtol(optarg, NULL, 10);
+                    if (pool_size < 1 || pool_size > MAX_CLIENTS) {
+                        LOG(ERROR, "bad number of devices: %s", optarg);
+                        exit(EXIT_FAILURE);
+                    }
+                    args.pool_size = (size_t) pool_size;
+                }
+                break;
             case 'p':
                 {
                     int port = strtol(optarg, NULL, 10);
@@ -226,6 +1719,11 @@ static struct args parse_args(int argc, char* argv[]) {
         }
     }
 
+    if (args.repeat_delay < 0) {
+        args.capabilities &= ~DEVICE_CAP_REPEAT;
+        args.repeat_delay = 0;
+    }
+
     return args;
 }
 
@@ -234,21 +1732,35 @@ int main(int argc, char* argv[]) {
 
     log_set_level(args.verbosity);
 
-    struct input_device device;
-    if (device_create(INPUT_DEVICE_NAME, &device) < 0) {
-        LOG(FATAL, "couldn't create input device");
-        exit(EXIT_FAILURE);
-    }
+    struct timespec start, started_at;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    install_signal_handlers();
+    struct event_loop* shards = calloc(args.shards, sizeof(*shards));
+    if (shards == NULL) FATAL_ERRNO("couldn't allocate shards");
 
-    struct server_info server;
-    if (server_create(args.local_host, args.local_port, &server) < 0) {
-        exit(EXIT_FAILURE);
+    for (size_t i = 0; i < args.shards; i++) {
+        if (event_loop_init(&shards[i], i, &args) < 0) {
+            exit(EXIT_FAILURE);
+        }
     }
 
-    LOG(NOTICE, "listening for connections on %s:%d", server.sv_addr,
-            server.sv_port);
+    clock_gettime(CLOCK_MONOTONIC, &started_at);
+    LOG(INFO, "set up %zu shard(s) in %.2f ms", args.shards,
+            (started_at.tv_sec - start.tv_sec) * 1000.0 +
+            (started_at.tv_nsec - start.tv_nsec) / 1000000.0);
+
+    LOG(NOTICE, "listening for connections on %s:%d", shards[0].server.sv_addr,
+            shards[0].server.sv_port);
+
+    /* Signals are blocked here, before any threads are started, so that they
+     * are only ever delivered through signal_fd */
+    int signal_fd = create_signal_fd();
+    if (signal_fd < 0) FATAL_ERRNO("couldn't set up signal handling");
+
+    int stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (stop_fd < 0) FATAL_ERRNO("couldn't create eventfd");
+    int exited_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (exited_fd < 0) FATAL_ERRNO("couldn't create eventfd");
 
     drop_privileges();
 
@@ -257,16 +1769,48 @@ int main(int argc, char* argv[]) {
         daemonize();
     }
 
-    struct client_info client;
-    while (!should_exit && server_accept(&server, &client) != -1) {
-        LOG(NOTICE, "accepted connection from %s", client.cl_addr);
-        handle_client(&client, &device);
+    size_t started = 0;
+    while (started < args.shards &&
+            event_loop_start(&shards[started], stop_fd, exited_fd) == 0) {
+        started++;
+    }
+
+    /* SIGUSR1 has every shard log its latency statistics */
+    int received = 0;
+    while (started == args.shards &&
+            (received = wait_for_signal(signal_fd, exited_fd)) == SIGUSR1) {
+        uint64_t dump = 1;
+        for (size_t i = 0; i < args.shards; i++) {
+            if (write(shards[i].dump_fd, &dump, sizeof(dump)) < 0) {
+                LOG_ERRNO("couldn't request statistics from shard %zu", i);
+            }
+        }
+    }
+
+    /* The eventfd is never read, so it stays readable in all shards */
+    uint64_t stop = 1;
+    if (write(stop_fd, &stop, sizeof(stop)) < 0) {
+        FATAL_ERRNO("couldn't stop shards");
     }
 
-    server_close(&server);
-    device_close(&device);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(shards[i].thread, NULL);
+    }
+
+    for (size_t i = 0; i < args.shards; i++) {
+        event_loop_close(&shards[i]);
+    }
+
+    free(shards);
+    close(stop_fd);
+    close(exited_fd);
+    close(signal_fd);
+
+    if (started < args.shards || received < 0) {
+        return EXIT_FAILURE;
+    }
 
     LOG(INFO, "terminating successfully");
 
-    return 0;
+    return EXIT_SUCCESS;
 }
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "sender.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/* Wake the sender up while working through a long X event queue as well, the
+ * same number of events as fits a stream connection's send buffer */
+#define SENDER_MAX_UNFLUSHED 64
+
+/* How often a full ring is checked for room while waiting to queue an event */
+#define SENDER_FULL_POLL_MS 1
+
+static void notify(int fd) {
+    uint64_t value = 1;
+    while (write(fd, &value, sizeof(value)) < 0 && errno == EINTR);
+}
+
+static void clear_notification(int fd) {
+    uint64_t value;
+    while (read(fd, &value, sizeof(value)) < 0 && errno == EINTR);
+}
+
+static void send_queued_events(struct sender* sender) {
+    struct client_event events[SENDER_MAX_UNFLUSHED];
+    size_t count;
+    while ((count = event_ring_pop(&sender->ring, events,
+                    SENDER_MAX_UNFLUSHED)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            connection_queue_event(sender->connection, &events[i]);
+        }
+    }
+
+    connection_flush(sender->connection);
+}
+
+static void* run_sender(void* arg) {
+    struct sender* sender = arg;
+    struct connection* connection = sender->connection;
+
+    for (;;) {
+        struct pollfd pfds[] = {
+            { .fd = sender->wakeup_fd, .events = POLLIN },
+            { .fd = connection->fd,
+                .events = connection_poll_events(connection) }
+        };
+        if (poll(pfds, 2, connection_timeout(connection)) < 0 &&
+                errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        if (pfds[0].revents) {
+            clear_notification(sender->wakeup_fd);
+        }
+
+        /* Checked before sending, so that nothing queued before stopping is
+         * left behind */
+        bool stopping = atomic_load(&sender->stopping);
+
+        send_queued_events(sender);
+
+        if (stopping) {
+            return NULL;
+        }
+
+        /* Being writable again is taken care of by sending above */
+        if ((pfds[1].revents & ~POLLOUT) &&
+                connection_handle_input(connection) < 0) {
+            fprintf(stderr, "Server closed the connection\n");
+            break;
+        }
+        if (connection_handle_timeout(connection) < 0) {
+            break;
+        }
+    }
+
+    notify(sender->closed_fd);
+
+    return NULL;
+}
+
+int sender_start(struct sender* sender, struct connection* connection) {
+    sender->connection = connection;
+    sender->unflushed = 0;
+    event_ring_init(&sender->ring);
+    atomic_init(&sender->stopping, false);
+
+    sender->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (sender->wakeup_fd < 0) {
+        return -1;
+    }
+
+    sender->closed_fd = eventfd(0, EFD_CLOEXEC);
+    if (sender->closed_fd < 0) {
+        goto error_wakeup;
+    }
+
+    if ((errno = pthread_create(&sender->thread, NULL, run_sender,
+                    sender)) != 0) {
+        goto error_closed;
+    }
+
+    return 0;
+
+error_closed:
+    close(sender->closed_fd);
+error_wakeup:
+    close(sender->wakeup_fd);
+    return -1;
+}
+
+/* Wakes up the sender and waits a moment for it to make room in the ring.
+ * Returns -1 if the sender has stopped, and will never make room.
+ */
+static int wait_for_room(struct sender* sender) {
+    sender->unflushed = 0;
+    notify(sender->wakeup_fd);
+
+    struct pollfd pfd = { .fd = sender->closed_fd, .events = POLLIN };
+    if (poll(&pfd, 1, SENDER_FULL_POLL_MS) > 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void sender_queue_event(struct sender* sender,
+        const struct client_event* event) {
+    /* The sender never blocks on the network, so the ring only fills up
+     * while it is waiting to be scheduled. Losing a bit of motion is
+     * harmless, but key transitions are waited on, as losing a release leaves
+     * the key stuck on the server */
+    bool motion = event->type == EV_MOUSE_DX || event->type == EV_MOUSE_DY ||
+        event->type == EV_WHEEL || event->type == EV_HWHEEL;
+    while (!event_ring_push(&sender->ring, event)) {
+        if (motion || wait_for_room(sender) < 0) {
+            fprintf(stderr, "Sender falling behind, dropping event %u\n",
+                    event->type);
+            return;
+        }
+    }
+
+    if (++sender->unflushed >= SENDER_MAX_UNFLUSHED) {
+        sender_flush(sender);
+    }
+}
+
+void sender_flush(struct sender* sender) {
+    if (sender->unflushed == 0) {
+        return;
+    }
+
+    sender->unflushed = 0;
+    notify(sender->wakeup_fd);
+}
+
+void sender_stop(struct sender* sender) {
+    atomic_store(&sender->stopping, true);
+    notify(sender->wakeup_fd);
+
+    pthread_join(sender->thread, NULL);
+
+    close(sender->wakeup_fd);
+    close(sender->closed_fd);
+}
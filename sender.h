@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _SENDER_H_
+#define _SENDER_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "connection.h"
+#include "event_ring.h"
+#include "shared.h"
+
+/*
+ * Sends events over a connection from a thread of its own, so that a stalled
+ * network never holds up reading the X event queue. Events are handed over
+ * through a ring and sent in batches whenever the sender is woken up.
+ */
+struct sender {
+    struct connection* connection;
+    struct event_ring ring;
+
+    pthread_t thread;
+    atomic_bool stopping;
+
+    /* Written to wake up the sender thread */
+    int wakeup_fd;
+    /* Becomes readable once the server has closed the connection */
+    int closed_fd;
+
+    /* Events queued since the sender was last woken up */
+    size_t unflushed;
+};
+
+/* Starts a sender thread for a connection which has been negotiated. Returns 0
+ * on success or -1 on error.
+ */
+int sender_start(struct sender* sender, struct connection* connection);
+
+/* Queues an event to be sent on the next flush. Motion is dropped if the
+ * sender is falling behind, while other events wait for it to catch up */
+void sender_queue_event(struct sender* sender,
+        const struct client_event* event);
+
+/* Wakes up the sender thread to send everything queued so far */
+void sender_flush(struct sender* sender);
+
+/* Sends everything still queued and stops the sender thread. The connection
+ * is left open.
+ */
+void sender_stop(struct sender* sender);
+
+#endif /* _SENDER_H_ */
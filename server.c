@@ -16,10 +16,12 @@
  * You should have received a copy of the GNU General Public License
  * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE /* recvmmsg */
 #include "server.h"
 
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <netdb.h>
@@ -27,17 +29,29 @@
 #include <sys/socket.h>
 
 #include "logging.h"
+#include "protocol.h"
 #include "shared.h"
 
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
-int server_create(const char* local_ip, uint16_t port,
+/* Room for the ancillary data of a received message */
+#define RECEIVE_CONTROL_SIZE CMSG_SPACE(sizeof(struct timespec))
+
+#ifndef SO_REUSEPORT
+/* Missing from some libc headers, even though the kernel supports it */
+#define SO_REUSEPORT 15
+#endif
+
+
+static int create_socket(const char* local_ip, uint16_t port, int socktype,
+        bool reuse_port, const struct socket_profile* profile,
         struct server_info* server) {
     char port_str[6];
     snprintf(port_str, sizeof(port_str), "%u", port);
 
     struct addrinfo bind_hints = {
         .ai_family = AF_UNSPEC,
-        .ai_socktype = SOCK_STREAM,
+        .ai_socktype = socktype,
         .ai_flags = AI_PASSIVE
     };
 
@@ -61,6 +75,26 @@ int server_create(const char* local_ip, uint16_t port,
         return -1;
     }
 
+    int enable = 1;
+    if (reuse_port && setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &enable,
+                sizeof(enable)) < 0) {
+        LOG_ERRNO("couldn't set SO_REUSEPORT");
+        goto cleanup;
+    }
+
+    /* Accepted connections inherit receive timestamps from the server */
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable,
+                sizeof(enable)) < 0) {
+        LOG_ERRNO("couldn't set SO_TIMESTAMPNS");
+    }
+
+    /* Applied before listening, for the receive buffer size to be taken
+     * into account for the TCP window of accepted connections */
+    if (socket_apply_profile(socket_fd, profile) < 0) {
+        LOG_ERRNO("couldn't apply socket profile");
+    }
+    server->sv_profile = *profile;
+
     if (bind(socket_fd, addr->ai_addr, addr->ai_addrlen) < 0) {
         LOG_ERRNO("bind error");
         goto cleanup;
@@ -81,11 +115,6 @@ int server_create(const char* local_ip, uint16_t port,
     inet_ntop(addr->ai_family, bound_address, server->sv_addr,
             sizeof(server->sv_addr));
 
-    if (listen(socket_fd, 1) < 0) {
-        LOG_ERRNO("listen error");
-        goto cleanup;
-    }
-
     freeaddrinfo(local_addrs);
 
     server->sv_fd = socket_fd;
@@ -98,10 +127,45 @@ cleanup:
     return -1;
 }
 
+int server_create(const char* local_ip, uint16_t port, bool reuse_port,
+        const struct socket_profile* profile, struct server_info* server) {
+    if (create_socket(local_ip, port, SOCK_STREAM, reuse_port, profile,
+                server) < 0) {
+        return -1;
+    }
+
+    if (listen(server->sv_fd, SOMAXCONN) < 0) {
+        LOG_ERRNO("listen error");
+        server_close(server);
+        return -1;
+    }
+
+    return 0;
+}
+
+int server_create_datagram(const char* local_ip, uint16_t port,
+        bool reuse_port, const struct socket_profile* profile,
+        struct server_info* server) {
+    return create_socket(local_ip, port, SOCK_DGRAM, reuse_port, profile,
+            server);
+}
+
 void server_close(struct server_info* server) {
     close(server->sv_fd);
 }
 
+static void format_address(const struct sockaddr_storage* sockaddr,
+        char* address, size_t address_size) {
+    if (sockaddr->ss_family == AF_INET) {
+        struct sockaddr_in* ipv4_addr = (struct sockaddr_in*)sockaddr;
+        inet_ntop(AF_INET, &ipv4_addr->sin_addr, address, address_size);
+    } else {
+        assert(sockaddr->ss_family == AF_INET6);
+        struct sockaddr_in6* ipv6_addr = (struct sockaddr_in6*)sockaddr;
+        inet_ntop(AF_INET6, &ipv6_addr->sin6_addr, address, address_size);
+    }
+}
+
 int server_accept(const struct server_info* server,
         struct client_info* client) {
     struct sockaddr_storage client_sockaddr;
@@ -109,42 +173,483 @@ int server_accept(const struct server_info* server,
     client->cl_fd = accept(server->sv_fd, (struct sockaddr*)&client_sockaddr,
             &client_addr_len);
     if (client->cl_fd < 0) {
-        if (errno != EINTR) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
             LOG_ERRNO("accept error");
         }
         return -1;
     }
 
-    if (client_sockaddr.ss_family == AF_INET) {
-        struct sockaddr_in* ipv4_addr = (struct sockaddr_in*)&client_sockaddr;
-        inet_ntop(AF_INET, &ipv4_addr->sin_addr, client->cl_addr,
-                sizeof(client->cl_addr));
-    } else {
-        assert(client_sockaddr.ss_family == AF_INET6);
-        struct sockaddr_in6* ipv6_addr = (struct sockaddr_in6*)&client_sockaddr;
-        inet_ntop(AF_INET6, &ipv6_addr->sin6_addr, client->cl_addr,
-                sizeof(client->cl_addr));
+    if (socket_apply_profile(client->cl_fd, &server->sv_profile) < 0) {
+        LOG_ERRNO("couldn't apply socket profile");
     }
+    client->cl_quick_ack = server->sv_profile.quick_ack;
+
+    client->cl_version = PROTOCOL_V1;
+    client->cl_capabilities = 0;
+    client->cl_negotiated = false;
+    client->cl_handshake_version = 0;
+    client->cl_handshake_capabilities = 0;
+    client->cl_buffer_start = 0;
+    client->cl_buffer_end = 0;
+    client->cl_send_length = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &client->cl_last_heard);
+    clock_sync_init(&client->cl_clock);
+    client->cl_capture_time = 0;
+    client->cl_round_trips = NULL;
+
+    format_address(&client_sockaddr, client->cl_addr, sizeof(client->cl_addr));
 
     return 0;
 }
 
-int read_client_event(struct client_info* client, struct client_event* event) {
-    uint8_t event_buffer[EV_MSG_SIZE];
+static void read_receive_timestamp(struct msghdr* message,
+        struct timespec* received) {
+    *received = (struct timespec) { 0 };
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(message); cmsg != NULL;
+            cmsg = CMSG_NXTHDR(message, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(received, CMSG_DATA(cmsg), sizeof(*received));
+        }
+    }
+}
 
-    ssize_t read_length = read(client->cl_fd, event_buffer,
-            sizeof(event_buffer));
-    if (read_length < 0 && errno != EINTR) {
-        LOG_ERRNO("error reading from client");
+ssize_t receive_client_data(struct client_info* client) {
+    /* Move any partially received message to the front of the buffer */
+    size_t buffered = client->cl_buffer_end - client->cl_buffer_start;
+    if (client->cl_buffer_start > 0) {
+        memmove(client->cl_buffer, &client->cl_buffer[client->cl_buffer_start],
+                buffered);
+        client->cl_buffer_start = 0;
+        client->cl_buffer_end = buffered;
+    }
+
+    size_t available = sizeof(client->cl_buffer) - client->cl_buffer_end;
+    if (available == 0) {
+        LOG(ERROR, "receive buffer full");
+        errno = ENOBUFS;
         return -1;
     }
 
-    if (read_length < (ssize_t)sizeof(event_buffer)) {
-        return 0;
+    struct iovec iovec = {
+        .iov_base = &client->cl_buffer[client->cl_buffer_end],
+        .iov_len = available
+    };
+    union {
+        char buffer[RECEIVE_CONTROL_SIZE];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message = {
+        .msg_iov = &iovec,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer)
+    };
+
+    ssize_t read_length;
+    do {
+        read_length = recvmsg(client->cl_fd, &message, 0);
+    } while (read_length < 0 && errno == EINTR);
+
+    if (read_length < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            LOG_ERRNO("error reading from client");
+        }
+        return -1;
+    }
+
+    client->cl_buffer_end += read_length;
+    read_receive_timestamp(&message, &client->cl_received);
+    if (read_length > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &client->cl_last_heard);
     }
 
-    event->type = ntohs(EV_MSG_FIELD(event_buffer, type));
-    event->value = ntohs(EV_MSG_FIELD(event_buffer, value));
+    if (client->cl_quick_ack && read_length > 0) {
+        socket_rearm_quick_ack(client->cl_fd);
+    }
 
     return read_length;
 }
+
+int flush_client(struct client_info* client) {
+    while (client->cl_send_length > 0) {
+        ssize_t written = write(client->cl_fd, client->cl_send_buffer,
+                client->cl_send_length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+
+            LOG_ERRNO("error writing to client");
+            return -1;
+        }
+
+        /* Whatever the socket didn't take goes first next time, so that the
+         * client never sees part of a message */
+        client->cl_send_length -= written;
+        memmove(client->cl_send_buffer, &client->cl_send_buffer[written],
+                client->cl_send_length);
+    }
+
+    return 0;
+}
+
+int send_client_event(struct client_info* client,
+        const struct client_event* event) {
+    if (client->cl_send_length + PROTOCOL_MAX_MSG_SIZE >
+            sizeof(client->cl_send_buffer)) {
+        return 0;
+    }
+
+    client->cl_send_length += protocol_encode_event(client->cl_version, event,
+            &client->cl_send_buffer[client->cl_send_length]);
+
+    return flush_client(client) < 0 ? -1 : 1;
+}
+
+static int negotiate_protocol(struct client_info* client,
+        const struct client_event* event) {
+    if (client->cl_negotiated) {
+        LOG(WARNING, "ignoring repeated handshake from %s", client->cl_addr);
+        return 0;
+    }
+
+    /* Switching over only once the client has the answer keeps both sides on
+     * version 1 if it gave up waiting for it */
+    if (client->cl_handshake_version != 0) {
+        if (event->type != EV_HELLO ||
+                event->value != client->cl_handshake_version) {
+            LOG(ERROR, "bad handshake acknowledgement from %s",
+                    client->cl_addr);
+            return -1;
+        }
+
+        client->cl_version = client->cl_handshake_version;
+        client->cl_capabilities = client->cl_handshake_capabilities;
+        client->cl_negotiated = true;
+
+        LOG(INFO, "using protocol version %d with %s (capabilities %#x)",
+                client->cl_version, client->cl_addr, client->cl_capabilities);
+        return 0;
+    }
+
+    if (event->type == EV_CAPABILITIES) {
+        client->cl_handshake_capabilities =
+            event->value & PROTOCOL_CAPABILITIES;
+        return 0;
+    }
+
+    /* EV_HELLO concludes the client's offer; answer it using version 1 */
+    struct client_event capabilities = {
+        .type = EV_CAPABILITIES,
+        .value = client->cl_handshake_capabilities
+    };
+    struct client_event hello = {
+        .type = EV_HELLO,
+        .value = MIN(event->value, PROTOCOL_VERSION)
+    };
+
+    if (hello.value < PROTOCOL_V1) {
+        LOG(WARNING, "bad protocol version from %s: %d", client->cl_addr,
+                event->value);
+        return 0;
+    }
+
+    /* Timestamps don't fit version 1, and heartbeats need them */
+    if (hello.value == PROTOCOL_V1) {
+        client->cl_handshake_capabilities &= ~PROTOCOL_CAP_TIMESTAMPS;
+    }
+    if (!(client->cl_handshake_capabilities & PROTOCOL_CAP_TIMESTAMPS)) {
+        client->cl_handshake_capabilities &= ~PROTOCOL_CAP_HEARTBEAT;
+    }
+    capabilities.value = client->cl_handshake_capabilities;
+
+    /* Both fit the send buffer, which the handshake is the first use of */
+    if (send_client_event(client, &capabilities) <= 0 ||
+            send_client_event(client, &hello) <= 0) {
+        LOG(ERROR, "couldn't answer handshake from %s", client->cl_addr);
+        return -1;
+    }
+
+    client->cl_handshake_version = hello.value;
+
+    return 0;
+}
+
+static void handle_pong(struct client_info* client,
+        const struct client_event* event) {
+    if (client->cl_capture_time == 0) {
+        LOG(WARNING, "pong without a timestamp from %s", client->cl_addr);
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint32_t received = protocol_timestamp(&now);
+    clock_sync_add_sample(&client->cl_clock, event->value,
+            client->cl_capture_time, received);
+    client->cl_capture_time = 0;
+
+    if (client->cl_round_trips != NULL) {
+        histogram_record(client->cl_round_trips,
+                (uint64_t)(received - (uint32_t)event->value) * 1000);
+    }
+}
+
+int next_client_event(struct client_info* client, struct client_event* event) {
+    for (;;) {
+        ssize_t length = protocol_decode_event(client->cl_version,
+                &client->cl_buffer[client->cl_buffer_start],
+                client->cl_buffer_end - client->cl_buffer_start, event);
+        if (length < 0) {
+            LOG(ERROR, "malformed message from %s", client->cl_addr);
+            return -1;
+        } else if (length == 0) {
+            return 0;
+        }
+
+        client->cl_buffer_start += length;
+
+        switch (event->type) {
+            case EV_CAPABILITIES:
+            case EV_HELLO:
+                if (negotiate_protocol(client, event) < 0) {
+                    return -1;
+                }
+                break;
+            case EV_TIMESTAMP:
+                client->cl_capture_time = event->value;
+                break;
+            case EV_PONG:
+                handle_pong(client, event);
+                break;
+            default:
+                event->time = client->cl_capture_time;
+                client->cl_capture_time = 0;
+                return 1;
+        }
+    }
+}
+
+int ping_client(struct client_info* client) {
+    if (!(client->cl_capabilities & PROTOCOL_CAP_TIMESTAMPS)) {
+        return 0;
+    }
+
+    /* A client not taking what was sent already isn't sent more */
+    if (client->cl_send_length > 0) {
+        return 0;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    struct client_event ping = {
+        .type = EV_PING,
+        .value = protocol_timestamp(&now)
+    };
+
+    return send_client_event(client, &ping) < 0 ? -1 : 0;
+}
+
+int read_client_event(struct client_info* client, struct client_event* event) {
+    int res;
+    while ((res = next_client_event(client, event)) == 0) {
+        ssize_t read_length = receive_client_data(client);
+        if (read_length <= 0) {
+            return read_length;
+        }
+    }
+
+    return res;
+}
+
+int receive_datagrams(const struct server_info* server,
+        struct datagram* datagrams, size_t count) {
+    struct mmsghdr messages[count];
+    struct iovec iovecs[count];
+    union {
+        char buffer[RECEIVE_CONTROL_SIZE];
+        struct cmsghdr align;
+    } controls[count];
+
+    memset(messages, 0, sizeof(messages));
+    for (size_t i = 0; i < count; i++) {
+        messages[i].msg_hdr.msg_control = controls[i].buffer;
+        messages[i].msg_hdr.msg_controllen = sizeof(controls[i].buffer);
+        iovecs[i].iov_base = datagrams[i].dg_data;
+        iovecs[i].iov_len = sizeof(datagrams[i].dg_data);
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_name = &datagrams[i].dg_sockaddr;
+        messages[i].msg_hdr.msg_namelen = sizeof(datagrams[i].dg_sockaddr);
+    }
+
+    int received;
+    do {
+        received = recvmmsg(server->sv_fd, messages, count, MSG_DONTWAIT,
+                NULL);
+    } while (received < 0 && errno == EINTR);
+
+    if (received < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            LOG_ERRNO("error receiving datagrams");
+        }
+        return -1;
+    }
+
+    for (int i = 0; i < received; i++) {
+        datagrams[i].dg_sockaddr_len = messages[i].msg_hdr.msg_namelen;
+        datagrams[i].dg_length = messages[i].msg_len;
+        read_receive_timestamp(&messages[i].msg_hdr, &datagrams[i].dg_received);
+    }
+
+    return received;
+}
+
+bool datagram_from_peer(const struct datagram* datagram,
+        const struct datagram_peer* peer) {
+    return datagram->dg_sockaddr_len == peer->dp_sockaddr_len &&
+        memcmp(&datagram->dg_sockaddr, &peer->dp_sockaddr,
+                datagram->dg_sockaddr_len) == 0;
+}
+
+void datagram_peer_init(struct datagram_peer* peer,
+        const struct datagram* datagram) {
+    peer->dp_sockaddr = datagram->dg_sockaddr;
+    peer->dp_sockaddr_len = datagram->dg_sockaddr_len;
+    format_address(&peer->dp_sockaddr, peer->dp_addr, sizeof(peer->dp_addr));
+
+    peer->dp_active = true;
+    peer->dp_started = false;
+    peer->dp_last_seq = 0;
+    peer->dp_next_key_seq = 0;
+    peer->dp_pointer_x = 0;
+    peer->dp_pointer_y = 0;
+    clock_gettime(CLOCK_MONOTONIC, &peer->dp_last_heard);
+}
+
+static void append_event(struct client_event* events, size_t* event_count,
+        uint16_t type, int32_t value) {
+    if (*event_count == DATAGRAM_MAX_EVENTS) {
+        return;
+    }
+
+    events[(*event_count)++] = (struct client_event) {
+        .type = type,
+        .value = value
+    };
+}
+
+ssize_t decode_datagram(struct datagram_peer* peer,
+        const struct datagram* datagram, struct client_event* events) {
+    struct datagram_header header;
+    ssize_t offset = protocol_decode_datagram_header(datagram->dg_data,
+            datagram->dg_length, &header);
+    if (offset < 0) {
+        LOG(ERROR, "short datagram from %s", peer->dp_addr);
+        return -1;
+    }
+
+    /* Every event takes at least a type and a single byte varint */
+    if (header.key_count > DATAGRAM_MAX_RELIABLE_EVENTS ||
+            header.key_count * 2 > datagram->dg_length - offset) {
+        LOG(ERROR, "bad reliable event count from %s: %u", peer->dp_addr,
+                header.key_count);
+        return -1;
+    }
+
+    /* Even stale datagrams show the peer is still there */
+    clock_gettime(CLOCK_MONOTONIC, &peer->dp_last_heard);
+
+    if (!peer->dp_started) {
+        /* Make sure motion of the very first datagram is applied */
+        peer->dp_last_seq = header.seq - 1;
+        peer->dp_started = true;
+    }
+
+    size_t event_count = 0;
+    for (uint8_t i = 0; i < header.key_count; i++) {
+        struct client_event event;
+        ssize_t length = protocol_decode_event(PROTOCOL_V2,
+                &datagram->dg_data[offset], datagram->dg_length - offset,
+                &event);
+        if (length <= 0) {
+            LOG(ERROR, "malformed datagram from %s", peer->dp_addr);
+            return -1;
+        }
+        offset += length;
+
+        /* Skip retransmissions of events already handled */
+        uint32_t key_seq = header.key_seq + i;
+        if (key_seq != peer->dp_next_key_seq) {
+            continue;
+        }
+
+        append_event(events, &event_count, event.type, event.value);
+        peer->dp_next_key_seq++;
+    }
+
+    /* Motion older than what's already been applied is of no use */
+    if (!SEQ_AFTER(header.seq, peer->dp_last_seq)) {
+        return event_count;
+    }
+    peer->dp_last_seq = header.seq;
+
+    int32_t dx = 0, dy = 0;
+    while ((size_t)offset < datagram->dg_length) {
+        struct client_event event;
+        ssize_t length = protocol_decode_event(PROTOCOL_V2,
+                &datagram->dg_data[offset], datagram->dg_length - offset,
+                &event);
+        if (length <= 0) {
+            LOG(ERROR, "malformed datagram from %s", peer->dp_addr);
+            return -1;
+        }
+        offset += length;
+
+        if (event.type == EV_POINTER_X) {
+            dx = (int32_t)((uint32_t)event.value -
+                    (uint32_t)peer->dp_pointer_x);
+            peer->dp_pointer_x = event.value;
+        } else if (event.type == EV_POINTER_Y) {
+            dy = (int32_t)((uint32_t)event.value -
+                    (uint32_t)peer->dp_pointer_y);
+            peer->dp_pointer_y = event.value;
+        }
+    }
+
+    if (dx != 0 || dy != 0) {
+        append_event(events, &event_count, EV_FRAME_BEGIN, 0);
+        if (dx != 0) append_event(events, &event_count, EV_MOUSE_DX, dx);
+        if (dy != 0) append_event(events, &event_count, EV_MOUSE_DY, dy);
+        append_event(events, &event_count, EV_FRAME_END, 0);
+    }
+
+    return event_count;
+}
+
+int acknowledge_datagrams(const struct server_info* server,
+        const struct datagram_peer* peer) {
+    struct datagram_header header = {
+        .seq = 0,
+        .key_seq = peer->dp_next_key_seq,
+        .key_count = 0
+    };
+
+    uint8_t buffer[DATAGRAM_HEADER_SIZE];
+    size_t length = protocol_encode_datagram_header(&header, buffer);
+
+    if (sendto(server->sv_fd, buffer, length, MSG_DONTWAIT,
+                (const struct sockaddr*)&peer->dp_sockaddr,
+                peer->dp_sockaddr_len) < 0) {
+        LOG_ERRNO("error acknowledging datagram from %s", peer->dp_addr);
+        return -1;
+    }
+
+    return 0;
+}
@@ -19,8 +19,21 @@
 #ifndef _SERVER_H_
 #define _SERVER_H_
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <netinet/in.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define CLIENT_RECEIVE_BUFFER_SIZE 4096
+/* Room for the handshake answer, or a ping, the socket didn't take at once */
+#define CLIENT_SEND_BUFFER_SIZE (4 * PROTOCOL_MAX_MSG_SIZE)
+
+#include "clock_sync.h"
+#include "histogram.h"
+#include "protocol.h"
+#include "socket_profile.h"
 
 struct client_event;
 
@@ -28,19 +41,159 @@ struct server_info {
     char sv_addr[INET6_ADDRSTRLEN];
     uint16_t sv_port;
     int sv_fd;
+    /* Applied to the server socket and every accepted client */
+    struct socket_profile sv_profile;
 };
 
 struct client_info {
     char cl_addr[INET6_ADDRSTRLEN];
     int cl_fd;
+    bool cl_quick_ack;
+
+    /* Negotiated protocol version and capabilities, see protocol.h */
+    int cl_version;
+    uint16_t cl_capabilities;
+    bool cl_negotiated;
+    /* Version and capabilities answered to the client's handshake, taking
+     * effect once the client acknowledges them. The version is 0 until the
+     * client has said hello */
+    int cl_handshake_version;
+    uint16_t cl_handshake_capabilities;
+
+    /* Data received from the client which hasn't been decoded yet. Unread
+     * data lives between cl_buffer_start and cl_buffer_end */
+    uint8_t cl_buffer[CLIENT_RECEIVE_BUFFER_SIZE];
+    size_t cl_buffer_start;
+    size_t cl_buffer_end;
+
+    /* Messages for the client which the socket hasn't taken yet */
+    uint8_t cl_send_buffer[CLIENT_SEND_BUFFER_SIZE];
+    size_t cl_send_length;
+
+    /* When the kernel received the data last read (CLOCK_REALTIME), or zero
+     * if it didn't say */
+    struct timespec cl_received;
+
+    /* When data was last received from the client (CLOCK_MONOTONIC) */
+    struct timespec cl_last_heard;
+
+    /* Offset of the client's clock, for telling when events were captured */
+    struct clock_sync cl_clock;
+    /* Capture time of the next event, from the last EV_TIMESTAMP */
+    uint32_t cl_capture_time;
+    /* Round trips of pings are recorded here, unless NULL */
+    struct histogram* cl_round_trips;
 };
 
-int server_create(const char* local_ip, uint16_t port, struct server_info*);
+/* A single datagram received by a datagram server */
+struct datagram {
+    struct sockaddr_storage dg_sockaddr;
+    socklen_t dg_sockaddr_len;
+    uint8_t dg_data[DATAGRAM_MAX_SIZE];
+    size_t dg_length;
+    /* When the kernel received the datagram, as cl_received */
+    struct timespec dg_received;
+};
+
+/* Session state of a client using the datagram transport */
+struct datagram_peer {
+    struct sockaddr_storage dp_sockaddr;
+    socklen_t dp_sockaddr_len;
+    char dp_addr[INET6_ADDRSTRLEN];
+
+    bool dp_active;
+    bool dp_started;
+    /* Sequence number of the newest datagram whose motion has been applied */
+    uint32_t dp_last_seq;
+    /* Sequence number of the next reliable event expected */
+    uint32_t dp_next_key_seq;
+    /* Accumulated pointer motion received so far */
+    int32_t dp_pointer_x;
+    int32_t dp_pointer_y;
+    /* When a datagram was last received from the peer (CLOCK_MONOTONIC) */
+    struct timespec dp_last_heard;
+};
+
+/* Upper bound of events decode_datagram() produces from a single datagram */
+#define DATAGRAM_MAX_EVENTS (DATAGRAM_MAX_RELIABLE_EVENTS + 4)
+
+/* Creates a listening socket. With reuse_port set, several servers may listen
+ * on the same address, with incoming connections spread among them.
+ */
+int server_create(const char* local_ip, uint16_t port, bool reuse_port,
+        const struct socket_profile* profile, struct server_info*);
+
+/* Creates a datagram socket for the datagram transport, see protocol.h */
+int server_create_datagram(const char* local_ip, uint16_t port,
+        bool reuse_port, const struct socket_profile* profile,
+        struct server_info*);
 
 void server_close(struct server_info*);
 
 int server_accept(const struct server_info*, struct client_info* client);
 
+/* Reads as much as is available from the client socket into the receive
+ * buffer, retrying on EINTR. Returns the number of bytes read, 0 if the client
+ * disconnected or -1 on error. For non-blocking sockets, -1 is also returned
+ * with errno set to EAGAIN if there is nothing to read.
+ */
+ssize_t receive_client_data(struct client_info* client);
+
+/* Decodes the next complete event from the receive buffer, answering any
+ * protocol handshake and taking in timestamps on the way. Returns 1 if an
+ * event was decoded, 0 if more data needs to be received first or -1 if the
+ * client sent garbage or the handshake couldn't be answered.
+ */
+int next_client_event(struct client_info* client, struct client_event* event);
+
+/* Queues an event for the client using the negotiated protocol version, and
+ * sends as much of the queue as the socket takes without blocking. Returns 1
+ * if the event was queued, 0 if there was no room for it or -1 on error.
+ */
+int send_client_event(struct client_info* client,
+        const struct client_event* event);
+
+/* Sends as much of what is queued for the client as the socket takes without
+ * blocking, leaving the rest in the send buffer. Returns 0 on success or -1 on
+ * error.
+ */
+int flush_client(struct client_info* client);
+
+/* Sends the client a ping, if it supports timestamps. The ping is skipped
+ * while earlier messages are still waiting to be sent. Returns 0 on success
+ * or -1 on error.
+ */
+int ping_client(struct client_info* client);
+
+/* Blocks until a complete event has been received from the client. Returns 1
+ * on success, 0 if the client disconnected or -1 on error.
+ */
 int read_client_event(struct client_info* client, struct client_event* event);
 
+/* Receives up to count datagrams from a non-blocking datagram server in a
+ * single system call. Returns the number of datagrams received or -1 on error,
+ * with errno set to EAGAIN if there was nothing to receive.
+ */
+int receive_datagrams(const struct server_info* server,
+        struct datagram* datagrams, size_t count);
+
+bool datagram_from_peer(const struct datagram* datagram,
+        const struct datagram_peer* peer);
+
+/* Starts a new session for the sender of datagram */
+void datagram_peer_init(struct datagram_peer* peer,
+        const struct datagram* datagram);
+
+/* Decodes a datagram from peer into events, which must have room for
+ * DATAGRAM_MAX_EVENTS. Reliable events already seen are skipped, and the
+ * accumulated pointer motion is turned into a single motion frame. Returns the
+ * number of events decoded or -1 if the datagram is malformed.
+ */
+ssize_t decode_datagram(struct datagram_peer* peer,
+        const struct datagram* datagram, struct client_event* events);
+
+/* Tells peer which reliable event is expected next */
+int acknowledge_datagrams(const struct server_info* server,
+        const struct datagram_peer* peer);
+
 #endif /* _SERVER_H_ */
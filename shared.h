@@ -19,7 +19,9 @@
 #ifndef _SHARED_H_
 #define _SHARED_H_
 
+#include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 
 #define sizeof_field(type, field) sizeof(((type*)NULL)->field)
 #define ssizeof(type) ((ssize_t)sizeof(type))
@@ -32,21 +34,66 @@
 #define EV_WHEEL        5
 #define EV_HWHEEL       6
 
+/* Events between EV_FRAME_BEGIN and EV_FRAME_END are reported as one */
+#define EV_FRAME_BEGIN  7
+#define EV_FRAME_END    8
+
+/* Protocol handshake, see protocol.h */
+#define EV_CAPABILITIES 9
+#define EV_HELLO        10
+
+/* Pointer motion accumulated since the start of a datagram session */
+#define EV_POINTER_X    11
+#define EV_POINTER_Y    12
+
+/* Releases every key held, before the client sends the keys still held */
+#define EV_RELEASE_ALL  13
+
+/* Clock synchronization, see protocol.h */
+#define EV_TIMESTAMP    14
+#define EV_PING         15
+#define EV_PONG         16
+
 struct client_event {
+    uint16_t type;
+    int32_t value;
+    /* When the event was captured by the client, as a protocol timestamp, or
+     * zero if unknown */
+    uint32_t time;
+};
+
+/* Layout of a version 1 message on the wire */
+struct client_event_v1 {
     uint16_t type;
     int16_t value;
 };
 
 #define EV_MSG_SIZE ( \
-            sizeof_field(struct client_event, type) + \
-            sizeof_field(struct client_event, value) \
+            sizeof_field(struct client_event_v1, type) + \
+            sizeof_field(struct client_event_v1, value) \
         )
 
 #define _EV_MSG_type_ptr(event_buffer) ((uint16_t*)event_buffer)
 #define _EV_MSG_value_ptr(event_buffer) \
         ((int16_t*)(((uint8_t*)event_buffer) + \
-            sizeof_field(struct client_event, type)))
+            sizeof_field(struct client_event_v1, type)))
 
 #define EV_MSG_FIELD(event_buffer, field) (*_EV_MSG_##field##_ptr(event_buffer))
 
+/* Returns the nanoseconds from since until until, or until now if until is
+ * NULL, both taken from CLOCK_MONOTONIC. Returns 0 if until is earlier.
+ */
+static inline uint64_t elapsed_ns(const struct timespec* since,
+        const struct timespec* until) {
+    struct timespec now;
+    if (until == NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        until = &now;
+    }
+
+    int64_t elapsed = (int64_t) (until->tv_sec - since->tv_sec) * 1000000000 +
+        (until->tv_nsec - since->tv_nsec);
+    return elapsed > 0 ? (uint64_t) elapsed : 0;
+}
+
 #endif /* _SHARED_H_ */
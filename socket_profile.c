@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE /* TCP_QUICKACK, TCP_USER_TIMEOUT */
+#include "socket_profile.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/* Interactive traffic, the highest priority not requiring CAP_NET_ADMIN */
+#define LOW_LATENCY_PRIORITY 6
+
+/* Keepalive probes only have a granularity of seconds, so an idle connection
+ * is probed after this long and given up on once TCP_USER_TIMEOUT has passed
+ * without an answer */
+#define KEEPALIVE_IDLE_S 1
+#define KEEPALIVE_INTERVAL_S 1
+
+/* Small send buffers keep events from queueing up behind each other when the
+ * link stalls, rather than arriving late in a burst */
+#define LOW_LATENCY_SEND_BUFFER (16 * 1024)
+#define LOW_LATENCY_RECEIVE_BUFFER (64 * 1024)
+
+const struct socket_profile socket_profile_low_latency = {
+    .no_delay = true,
+    .quick_ack = true,
+    .dscp = DSCP_EF,
+    .priority = LOW_LATENCY_PRIORITY,
+    .send_buffer = LOW_LATENCY_SEND_BUFFER,
+    .receive_buffer = LOW_LATENCY_RECEIVE_BUFFER
+};
+
+static int set_option(int fd, int level, int name, int value, int* error) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+        *error = errno;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int socket_type(int fd) {
+    int type;
+    socklen_t type_len = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_len) < 0) {
+        return -1;
+    }
+
+    return type;
+}
+
+static int socket_family(int fd) {
+    struct sockaddr_storage local_addr;
+    socklen_t local_addr_len = sizeof(local_addr);
+    if (getsockname(fd, (struct sockaddr*)&local_addr, &local_addr_len) < 0) {
+        return -1;
+    }
+
+    return local_addr.ss_family;
+}
+
+int socket_apply_profile(int fd, const struct socket_profile* profile) {
+    int error = 0;
+
+    if ((profile->no_delay || profile->quick_ack ||
+                profile->peer_timeout != 0) &&
+            socket_type(fd) == SOCK_STREAM) {
+        if (profile->no_delay) {
+            set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, &error);
+        }
+        if (profile->quick_ack) {
+            set_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1, &error);
+        }
+        if (profile->peer_timeout != 0) {
+            set_option(fd, IPPROTO_TCP, TCP_USER_TIMEOUT,
+                    profile->peer_timeout, &error);
+            set_option(fd, SOL_SOCKET, SO_KEEPALIVE, 1, &error);
+            set_option(fd, IPPROTO_TCP, TCP_KEEPIDLE, KEEPALIVE_IDLE_S,
+                    &error);
+            set_option(fd, IPPROTO_TCP, TCP_KEEPINTVL, KEEPALIVE_INTERVAL_S,
+                    &error);
+        }
+    }
+
+    if (profile->dscp != 0) {
+        /* DSCP is the upper six bits of the TOS/traffic class field */
+        int tos = profile->dscp << 2;
+        if (socket_family(fd) == AF_INET6) {
+            set_option(fd, IPPROTO_IPV6, IPV6_TCLASS, tos, &error);
+        } else {
+            set_option(fd, IPPROTO_IP, IP_TOS, tos, &error);
+        }
+    }
+
+    if (profile->priority != 0) {
+        set_option(fd, SOL_SOCKET, SO_PRIORITY, profile->priority, &error);
+    }
+    if (profile->send_buffer != 0) {
+        set_option(fd, SOL_SOCKET, SO_SNDBUF, profile->send_buffer, &error);
+    }
+    if (profile->receive_buffer != 0) {
+        set_option(fd, SOL_SOCKET, SO_RCVBUF, profile->receive_buffer,
+                &error);
+    }
+
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+void socket_rearm_quick_ack(int fd) {
+    int error;
+    set_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1, &error);
+}
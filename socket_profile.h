@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _SOCKET_PROFILE_H_
+#define _SOCKET_PROFILE_H_
+
+#include <stdbool.h>
+
+/* Expedited Forwarding, the DSCP class meant for low-latency traffic */
+#define DSCP_EF 46
+#define DSCP_MAX 63
+
+/* Socket options tuned for input events, which are tiny and need to get
+ * through as fast as possible. A zeroed profile leaves sockets untouched.
+ */
+struct socket_profile {
+    /* Disable Nagle's algorithm, which holds back small writes */
+    bool no_delay;
+    /* Acknowledge received data right away rather than delaying the ACK */
+    bool quick_ack;
+    /* DSCP class to mark traffic with, 0 leaves it unmarked */
+    int dscp;
+    /* SO_PRIORITY of the socket, 0 keeps the default */
+    int priority;
+    /* Socket buffer sizes, 0 keeps the system defaults */
+    int send_buffer;
+    int receive_buffer;
+    /* Milliseconds after which a connection whose peer stopped acknowledging
+     * data is dropped, through TCP_USER_TIMEOUT and keepalive probes. 0 keeps
+     * the system defaults */
+    int peer_timeout;
+};
+
+extern const struct socket_profile socket_profile_low_latency;
+
+/* Applies profile to a socket. TCP options are skipped on other sockets.
+ * Every option is tried, and -1 is returned with errno set if any of them
+ * couldn't be set, otherwise 0.
+ */
+int socket_apply_profile(int fd, const struct socket_profile* profile);
+
+/* TCP_QUICKACK is cleared by the kernel as it sees fit, so it needs to be set
+ * again after receiving data on sockets using it.
+ */
+void socket_rearm_quick_ack(int fd);
+
+#endif /* _SOCKET_PROFILE_H_ */
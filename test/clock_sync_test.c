@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "test/test_suites.h"
+
+#include <check.h>
+#include <stdint.h>
+
+#include "clock_sync.h"
+
+static struct clock_sync sync;
+
+START_TEST(test_clock_sync_no_samples) {
+    clock_sync_init(&sync);
+
+    uint32_t local;
+    ck_assert_int_eq(-1, clock_sync_to_local(&sync, 1000, &local));
+    ck_assert_uint_eq(0, clock_sync_round_trip(&sync));
+} END_TEST
+
+START_TEST(test_clock_sync_offset) {
+    clock_sync_init(&sync);
+
+    /* The peer's clock is 5000 us ahead, with 100 us each way */
+    clock_sync_add_sample(&sync, 1000, 6100, 1200);
+
+    uint32_t local;
+    ck_assert_int_eq(0, clock_sync_to_local(&sync, 7000, &local));
+    ck_assert_uint_eq(2000, local);
+    ck_assert_uint_eq(200, clock_sync_round_trip(&sync));
+} END_TEST
+
+START_TEST(test_clock_sync_shortest_round_trip) {
+    clock_sync_init(&sync);
+
+    /* Queueing on the way back makes the peer seem behind */
+    clock_sync_add_sample(&sync, 1000, 6100, 3200);
+    clock_sync_add_sample(&sync, 2000, 7100, 2200);
+    clock_sync_add_sample(&sync, 3000, 8100, 4200);
+
+    uint32_t local;
+    ck_assert_int_eq(0, clock_sync_to_local(&sync, 10000, &local));
+    ck_assert_uint_eq(5000, local);
+    ck_assert_uint_eq(200, clock_sync_round_trip(&sync));
+
+    /* The best sample ages out eventually */
+    for (int i = 0; i < CLOCK_SYNC_SAMPLES; i++) {
+        clock_sync_add_sample(&sync, 10000, 15300, 10400);
+    }
+    ck_assert_uint_eq(400, clock_sync_round_trip(&sync));
+} END_TEST
+
+START_TEST(test_clock_sync_wrap) {
+    clock_sync_init(&sync);
+
+    /* Both clocks wrap during the ping */
+    clock_sync_add_sample(&sync, UINT32_MAX - 99, 49, 100);
+
+    uint32_t local;
+    ck_assert_int_eq(0, clock_sync_to_local(&sync, 149, &local));
+    ck_assert_uint_eq(100, local);
+} END_TEST
+
+START_TEST(test_clock_sync_late_answer) {
+    clock_sync_init(&sync);
+
+    clock_sync_add_sample(&sync, 1000, 6100,
+            1000 + CLOCK_SYNC_MAX_ROUND_TRIP_US + 1);
+
+    ck_assert_uint_eq(0, clock_sync_round_trip(&sync));
+} END_TEST
+
+Suite* clock_sync_suite(void) {
+    Suite* clock_sync_suite = suite_create("clock_sync.c");
+
+    TCase* clock_sync_testcase = tcase_create("clock_sync");
+
+    tcase_add_test(clock_sync_testcase, test_clock_sync_no_samples);
+    tcase_add_test(clock_sync_testcase, test_clock_sync_offset);
+    tcase_add_test(clock_sync_testcase, test_clock_sync_shortest_round_trip);
+    tcase_add_test(clock_sync_testcase, test_clock_sync_wrap);
+    tcase_add_test(clock_sync_testcase, test_clock_sync_late_answer);
+
+    suite_add_tcase(clock_sync_suite, clock_sync_testcase);
+
+    return clock_sync_suite;
+}
@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "test/test_suites.h"
+
+#include <check.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "connection.h"
+#include "protocol.h"
+#include "shared.h"
+
+static struct connection connection;
+
+static int mock_connection(uint16_t capabilities) {
+    int fds[2];
+    ck_assert_int_eq(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+    memset(&connection, 0, sizeof(connection));
+    connection.fd = fds[0];
+    connection.version = PROTOCOL_V2;
+    connection.capabilities = capabilities;
+
+    return fds[1];
+}
+
+static void queue_event(uint16_t type, int32_t value) {
+    struct client_event event = { .type = type, .value = value };
+    connection_queue_event(&connection, &event);
+}
+
+static void assert_next_event(const uint8_t* buffer, size_t length,
+        size_t* offset, uint16_t type, int32_t value) {
+    struct client_event event;
+    ssize_t res = protocol_decode_event(PROTOCOL_V2, &buffer[*offset],
+            length - *offset, &event);
+    ck_assert_int_gt(res, 0);
+    ck_assert_uint_eq(event.type, type);
+    ck_assert_int_eq(event.value, value);
+    *offset += res;
+}
+
+START_TEST(test_connection_negotiate) {
+    int peer_fd = mock_connection(0);
+    connection.version = PROTOCOL_V1;
+
+    const struct client_event reply[] = {
+        { .type = EV_CAPABILITIES, .value = PROTOCOL_CAP_FRAMES },
+        { .type = EV_HELLO, .value = PROTOCOL_V2 }
+    };
+    uint8_t buffer[4 * EV_MSG_SIZE];
+    protocol_encode_event(PROTOCOL_V1, &reply[0], &buffer[0]);
+    protocol_encode_event(PROTOCOL_V1, &reply[1], &buffer[EV_MSG_SIZE]);
+    ck_assert_int_eq(2 * EV_MSG_SIZE, write(peer_fd, buffer,
+                2 * EV_MSG_SIZE));
+
+    ck_assert_int_eq(0, connection_negotiate(&connection, PROTOCOL_V2));
+    ck_assert_int_eq(connection.version, PROTOCOL_V2);
+    ck_assert_uint_eq(connection.capabilities, PROTOCOL_CAP_FRAMES);
+
+    /* The offer is followed by acknowledging the answer, using version 1 */
+    ck_assert_int_eq(3 * EV_MSG_SIZE, read(peer_fd, buffer, sizeof(buffer)));
+    struct client_event event;
+    protocol_decode_event(PROTOCOL_V1, &buffer[0], EV_MSG_SIZE, &event);
+    ck_assert_uint_eq(event.type, EV_CAPABILITIES);
+    protocol_decode_event(PROTOCOL_V1, &buffer[EV_MSG_SIZE], EV_MSG_SIZE,
+            &event);
+    ck_assert_uint_eq(event.type, EV_HELLO);
+    protocol_decode_event(PROTOCOL_V1, &buffer[2 * EV_MSG_SIZE], EV_MSG_SIZE,
+            &event);
+    ck_assert_uint_eq(event.type, EV_HELLO);
+    ck_assert_int_eq(event.value, PROTOCOL_V2);
+
+    close(peer_fd);
+    close(connection.fd);
+} END_TEST
+
+START_TEST(test_connection_merges_motion) {
+    int peer_fd = mock_connection(PROTOCOL_CAPABILITIES);
+
+    queue_event(EV_FRAME_BEGIN, 0);
+    queue_event(EV_MOUSE_DX, 1);
+    queue_event(EV_MOUSE_DY, 3);
+    queue_event(EV_FRAME_END, 0);
+    queue_event(EV_MOUSE_DX, 2);
+    queue_event(EV_KEY_DOWN, 30);
+    queue_event(EV_MOUSE_DX, 4);
+    connection_flush(&connection);
+    ck_assert_uint_eq(connection.stats.merged, 1);
+
+    uint8_t buffer[64];
+    ssize_t length = read(peer_fd, buffer, sizeof(buffer));
+    size_t offset = 0;
+    assert_next_event(buffer, length, &offset, EV_FRAME_BEGIN, 0);
+    assert_next_event(buffer, length, &offset, EV_MOUSE_DX, 3);
+    assert_next_event(buffer, length, &offset, EV_MOUSE_DY, 3);
+    assert_next_event(buffer, length, &offset, EV_FRAME_END, 0);
+    assert_next_event(buffer, length, &offset, EV_KEY_DOWN, 30);
+    assert_next_event(buffer, length, &offset, EV_MOUSE_DX, 4);
+    ck_assert_uint_eq(offset, length);
+
+    close(peer_fd);
+    close(connection.fd);
+} END_TEST
+
+START_TEST(test_connection_resyncs_when_full) {
+    int peer_fd = mock_connection(PROTOCOL_CAPABILITIES);
+
+    queue_event(EV_KEY_DOWN, 30);
+    for (int i = 0; i < EVENT_QUEUE_SIZE; i++) {
+        queue_event(i % 2 == 0 ? EV_KEY_DOWN : EV_KEY_UP, 31);
+    }
+    ck_assert_uint_eq(connection.stats.resyncs, 1);
+    ck_assert_uint_eq(connection.stats.dropped, EVENT_QUEUE_SIZE);
+
+    /* The queue is replaced by the key state as of the last event */
+    ck_assert_uint_eq(connection.queue_length, 2);
+    connection_flush(&connection);
+
+    uint8_t buffer[64];
+    ssize_t length = read(peer_fd, buffer, sizeof(buffer));
+    size_t offset = 0;
+    assert_next_event(buffer, length, &offset, EV_RELEASE_ALL, 0);
+    assert_next_event(buffer, length, &offset, EV_KEY_DOWN, 30);
+    ck_assert_uint_eq(offset, length);
+
+    close(peer_fd);
+    close(connection.fd);
+} END_TEST
+
+START_TEST(test_connection_keeps_motion_after_resync) {
+    int peer_fd = mock_connection(PROTOCOL_CAPABILITIES);
+
+    queue_event(EV_KEY_DOWN, 30);
+    for (int i = 0; i < EVENT_QUEUE_SIZE - 1; i++) {
+        queue_event(i % 2 == 0 ? EV_KEY_DOWN : EV_KEY_UP, 31);
+    }
+
+    /* Motion making the queue overflow goes after the key state */
+    queue_event(EV_MOUSE_DX, 5);
+    ck_assert_uint_eq(connection.stats.resyncs, 1);
+    ck_assert_uint_eq(connection.stats.dropped, EVENT_QUEUE_SIZE);
+    ck_assert_uint_eq(connection.queue_length, 4);
+    connection_flush(&connection);
+
+    uint8_t buffer[64];
+    ssize_t length = read(peer_fd, buffer, sizeof(buffer));
+    size_t offset = 0;
+    assert_next_event(buffer, length, &offset, EV_RELEASE_ALL, 0);
+    assert_next_event(buffer, length, &offset, EV_KEY_DOWN, 30);
+    assert_next_event(buffer, length, &offset, EV_KEY_DOWN, 31);
+    assert_next_event(buffer, length, &offset, EV_MOUSE_DX, 5);
+    ck_assert_uint_eq(offset, length);
+
+    close(peer_fd);
+    close(connection.fd);
+} END_TEST
+
+START_TEST(test_connection_keeps_keys_without_release_all) {
+    int peer_fd = mock_connection(PROTOCOL_CAP_FRAMES);
+
+    queue_event(EV_KEY_DOWN, 30);
+    for (int i = 0; i < EVENT_QUEUE_SIZE - 1; i++) {
+        queue_event(i % 2 == 0 ? EV_WHEEL : EV_KEY_UP, 30);
+    }
+
+    /* Only motion is dropped to make room */
+    queue_event(EV_KEY_DOWN, 31);
+    ck_assert_uint_eq(connection.stats.resyncs, 0);
+    ck_assert_uint_eq(connection.stats.dropped, EVENT_QUEUE_SIZE / 2);
+    ck_assert_uint_eq(connection.queue_length, EVENT_QUEUE_SIZE / 2 + 1);
+
+    close(peer_fd);
+    close(connection.fd);
+} END_TEST
+
+START_TEST(test_connection_timestamps) {
+    int peer_fd = mock_connection(PROTOCOL_CAPABILITIES);
+
+    struct client_event event = {
+        .type = EV_MOUSE_DX,
+        .value = 1,
+        .time = 1000
+    };
+    connection_queue_event(&connection, &event);
+    event.type = EV_MOUSE_DY;
+    event.time = 1500;
+    connection_queue_event(&connection, &event);
+    event.type = EV_MOUSE_DX;
+    event.time = 2000;
+    connection_queue_event(&connection, &event);
+    queue_event(EV_KEY_DOWN, 30);
+    connection_flush(&connection);
+
+    /* Merged motion keeps the earliest capture time, and untimed events go
+     * without */
+    uint8_t buffer[64];
+    ssize_t length = read(peer_fd, buffer, sizeof(buffer));
+    size_t offset = 0;
+    assert_next_event(buffer, length, &offset, EV_FRAME_BEGIN, 0);
+    assert_next_event(buffer, length, &offset, EV_TIMESTAMP, 1000);
+    assert_next_event(buffer, length, &offset, EV_MOUSE_DX, 2);
+    assert_next_event(buffer, length, &offset, EV_MOUSE_DY, 1);
+    assert_next_event(buffer, length, &offset, EV_FRAME_END, 0);
+    assert_next_event(buffer, length, &offset, EV_KEY_DOWN, 30);
+    ck_assert_uint_eq(offset, length);
+
+    close(peer_fd);
+    close(connection.fd);
+} END_TEST
+
+START_TEST(test_connection_answers_ping) {
+    int peer_fd = mock_connection(PROTOCOL_CAPABILITIES);
+
+    /* Sent in two parts, to be put back together */
+    struct client_event ping = { .type = EV_PING, .value = -123456 };
+    uint8_t ping_buffer[PROTOCOL_MAX_MSG_SIZE];
+    size_t ping_size = protocol_encode_event(PROTOCOL_V2, &ping, ping_buffer);
+    ck_assert_int_eq(2, write(peer_fd, ping_buffer, 2));
+    ck_assert_int_eq(0, connection_handle_input(&connection));
+    ck_assert_int_eq(ping_size - 2, write(peer_fd, &ping_buffer[2],
+                ping_size - 2));
+    ck_assert_int_eq(0, connection_handle_input(&connection));
+
+    uint8_t buffer[64];
+    ssize_t length = read(peer_fd, buffer, sizeof(buffer));
+    size_t offset = 0;
+    struct client_event timestamp;
+    offset += protocol_decode_event(PROTOCOL_V2, buffer, length, &timestamp);
+    ck_assert_uint_eq(timestamp.type, EV_TIMESTAMP);
+    assert_next_event(buffer, length, &offset, EV_PONG, -123456);
+    ck_assert_uint_eq(offset, length);
+
+    close(peer_fd);
+    ck_assert_int_eq(-1, connection_handle_input(&connection));
+    close(connection.fd);
+} END_TEST
+
+START_TEST(test_connection_holds_datagram_events) {
+    int peer_fd = mock_connection(PROTOCOL_CAPABILITIES);
+    connection.datagrams = true;
+
+    for (int i = 0; i < DATAGRAM_MAX_RELIABLE_EVENTS; i++) {
+        queue_event(i % 2 == 0 ? EV_KEY_DOWN : EV_KEY_UP, 31);
+    }
+
+    /* Without room for the key, it and the motion after it are held back */
+    queue_event(EV_MOUSE_DX, 5);
+    queue_event(EV_KEY_DOWN, 30);
+    queue_event(EV_MOUSE_DX, 2);
+    ck_assert_int_eq(connection.pointer_x, 5);
+    ck_assert_uint_eq(connection.queue_length, 2);
+    ck_assert_uint_eq(connection.stats.dropped, 0);
+
+    /* Acknowledging the first reliable event makes room for them */
+    struct datagram_header ack = { .key_seq = 1 };
+    uint8_t buffer[DATAGRAM_HEADER_SIZE];
+    protocol_encode_datagram_header(&ack, buffer);
+    ck_assert_int_eq(DATAGRAM_HEADER_SIZE, write(peer_fd, buffer,
+                DATAGRAM_HEADER_SIZE));
+    ck_assert_int_eq(0, connection_handle_input(&connection));
+
+    ck_assert_uint_eq(connection.queue_length, 0);
+    ck_assert_uint_eq(connection.reliable_count, DATAGRAM_MAX_RELIABLE_EVENTS);
+    const struct client_event* last =
+        &connection.reliable[DATAGRAM_MAX_RELIABLE_EVENTS - 1];
+    ck_assert_uint_eq(last->type, EV_KEY_DOWN);
+    ck_assert_int_eq(last->value, 30);
+    ck_assert_int_eq(connection.pointer_x, 7);
+
+    close(peer_fd);
+    close(connection.fd);
+} END_TEST
+
+START_TEST(test_connection_heartbeat_timeout) {
+    int peer_fd = mock_connection(PROTOCOL_CAPABILITIES &
+            ~PROTOCOL_CAP_HEARTBEAT);
+    ck_assert_int_eq(-1, connection_timeout(&connection));
+    ck_assert_int_eq(0, connection_handle_timeout(&connection));
+    connection.capabilities = PROTOCOL_CAPABILITIES;
+
+    /* Heard from just now */
+    clock_gettime(CLOCK_MONOTONIC, &connection.last_heard);
+    ck_assert_int_gt(connection_timeout(&connection), 0);
+    ck_assert_int_le(connection_timeout(&connection),
+            CONNECTION_HEARTBEAT_TIMEOUT_MS);
+    ck_assert_int_eq(0, connection_handle_timeout(&connection));
+
+    /* Silent for too long */
+    connection.last_heard.tv_sec -= CONNECTION_HEARTBEAT_TIMEOUT_MS / 1000 + 1;
+    ck_assert_int_eq(0, connection_timeout(&connection));
+    ck_assert_int_eq(-1, connection_handle_timeout(&connection));
+
+    /* Anything from the server counts */
+    struct client_event ping = { .type = EV_PING, .value = 1 };
+    uint8_t buffer[PROTOCOL_MAX_MSG_SIZE];
+    size_t size = protocol_encode_event(PROTOCOL_V2, &ping, buffer);
+    ck_assert_int_eq(size, write(peer_fd, buffer, size));
+    ck_assert_int_eq(0, connection_handle_input(&connection));
+    ck_assert_int_gt(connection_timeout(&connection), 0);
+
+    close(peer_fd);
+    close(connection.fd);
+} END_TEST
+
+Suite* connection_suite(void) {
+    Suite* connection_suite = suite_create("connection.c");
+
+    TCase* connection_testcase = tcase_create("connection");
+
+    tcase_add_test(connection_testcase, test_connection_negotiate);
+    tcase_add_test(connection_testcase, test_connection_merges_motion);
+    tcase_add_test(connection_testcase, test_connection_resyncs_when_full);
+    tcase_add_test(connection_testcase,
+            test_connection_keeps_motion_after_resync);
+    tcase_add_test(connection_testcase,
+            test_connection_keeps_keys_without_release_all);
+    tcase_add_test(connection_testcase, test_connection_timestamps);
+    tcase_add_test(connection_testcase, test_connection_answers_ping);
+    tcase_add_test(connection_testcase,
+            test_connection_holds_datagram_events);
+    tcase_add_test(connection_testcase, test_connection_heartbeat_timeout);
+
+    suite_add_tcase(connection_suite, connection_testcase);
+
+    return connection_suite;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "test/test_suites.h"
+
+#include <check.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "event_ring.h"
+#include "shared.h"
+
+static struct event_ring ring;
+
+static void push_event(uint16_t type, int32_t value) {
+    struct client_event event = { .type = type, .value = value };
+    ck_assert(event_ring_push(&ring, &event));
+}
+
+START_TEST(test_event_ring_fifo) {
+    event_ring_init(&ring);
+
+    push_event(EV_KEY_DOWN, 30);
+    push_event(EV_MOUSE_DX, -5);
+    push_event(EV_KEY_UP, 30);
+
+    struct client_event events[4];
+    ck_assert_uint_eq(2, event_ring_pop(&ring, events, 2));
+    ck_assert_uint_eq(events[0].type, EV_KEY_DOWN);
+    ck_assert_uint_eq(events[1].type, EV_MOUSE_DX);
+    ck_assert_int_eq(events[1].value, -5);
+
+    ck_assert_uint_eq(1, event_ring_pop(&ring, events, 4));
+    ck_assert_uint_eq(events[0].type, EV_KEY_UP);
+    ck_assert_uint_eq(0, event_ring_pop(&ring, events, 4));
+} END_TEST
+
+START_TEST(test_event_ring_full) {
+    event_ring_init(&ring);
+
+    for (int i = 0; i < EVENT_RING_SIZE; i++) {
+        push_event(EV_MOUSE_DX, i);
+    }
+
+    struct client_event event = { .type = EV_KEY_DOWN, .value = 1 };
+    ck_assert(!event_ring_push(&ring, &event));
+
+    /* Room is made as events are taken, wrapping around the array */
+    struct client_event popped;
+    ck_assert_uint_eq(1, event_ring_pop(&ring, &popped, 1));
+    ck_assert_int_eq(popped.value, 0);
+    ck_assert(event_ring_push(&ring, &event));
+} END_TEST
+
+#define THREADED_EVENT_COUNT (64 * EVENT_RING_SIZE)
+
+static void* produce_events(void* arg) {
+    for (int32_t i = 0; i < THREADED_EVENT_COUNT; i++) {
+        struct client_event event = { .type = EV_MOUSE_DX, .value = i };
+        while (!event_ring_push(&ring, &event));
+    }
+
+    return NULL;
+}
+
+START_TEST(test_event_ring_threaded) {
+    event_ring_init(&ring);
+
+    pthread_t producer;
+    ck_assert_int_eq(0, pthread_create(&producer, NULL, produce_events, NULL));
+
+    /* Events arrive complete and in order while both ends run concurrently */
+    int32_t expected = 0;
+    while (expected < THREADED_EVENT_COUNT) {
+        struct client_event events[16];
+        size_t count = event_ring_pop(&ring, events, 16);
+        for (size_t i = 0; i < count; i++) {
+            ck_assert_int_eq(events[i].value, expected++);
+        }
+    }
+
+    pthread_join(producer, NULL);
+} END_TEST
+
+Suite* event_ring_suite(void) {
+    Suite* event_ring_suite = suite_create("event_ring.c");
+
+    TCase* event_ring_testcase = tcase_create("event_ring");
+
+    tcase_add_test(event_ring_testcase, test_event_ring_fifo);
+    tcase_add_test(event_ring_testcase, test_event_ring_full);
+    tcase_add_test(event_ring_testcase, test_event_ring_threaded);
+
+    suite_add_tcase(event_ring_suite, event_ring_testcase);
+
+    return event_ring_suite;
+}
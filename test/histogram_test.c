@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "test/test_suites.h"
+
+#include <check.h>
+#include <stdint.h>
+
+#include "histogram.h"
+
+static struct histogram histogram;
+
+START_TEST(test_histogram_empty) {
+    histogram_init(&histogram);
+
+    ck_assert_uint_eq(0, histogram_percentile(&histogram, 50));
+    ck_assert_uint_eq(0, histogram_percentile(&histogram, 100));
+} END_TEST
+
+START_TEST(test_histogram_small_values) {
+    histogram_init(&histogram);
+
+    /* Values below 2^HISTOGRAM_SUB_BITS are kept exactly */
+    for (uint64_t i = 1; i <= 10; i++) {
+        histogram_record(&histogram, i);
+    }
+
+    ck_assert_uint_eq(histogram.total, 10);
+    ck_assert_uint_eq(1, histogram_percentile(&histogram, 0));
+    ck_assert_uint_eq(5, histogram_percentile(&histogram, 50));
+    ck_assert_uint_eq(9, histogram_percentile(&histogram, 90));
+    ck_assert_uint_eq(10, histogram_percentile(&histogram, 100));
+} END_TEST
+
+START_TEST(test_histogram_precision) {
+    histogram_init(&histogram);
+
+    for (uint64_t i = 1; i <= 100000; i++) {
+        histogram_record(&histogram, i * 1000);
+    }
+
+    /* Percentiles come out no lower, and at most 1/16 higher, than the
+     * recorded values */
+    uint64_t median = histogram_percentile(&histogram, 50);
+    ck_assert_uint_ge(median, 50000000);
+    ck_assert_uint_le(median, 50000000 + 50000000 / HISTOGRAM_SUB_BUCKETS);
+
+    uint64_t p99 = histogram_percentile(&histogram, 99);
+    ck_assert_uint_ge(p99, 99000000);
+    ck_assert_uint_le(p99, 99000000 + 99000000 / HISTOGRAM_SUB_BUCKETS);
+
+    ck_assert_uint_eq(100000000, histogram_percentile(&histogram, 100));
+} END_TEST
+
+START_TEST(test_histogram_huge_values) {
+    histogram_init(&histogram);
+
+    histogram_record(&histogram, UINT64_MAX);
+
+    ck_assert_uint_eq(histogram.counts[HISTOGRAM_BUCKETS - 1], 1);
+    ck_assert_uint_eq(histogram.max, UINT64_MAX);
+} END_TEST
+
+Suite* histogram_suite(void) {
+    Suite* histogram_suite = suite_create("histogram.c");
+
+    TCase* histogram_testcase = tcase_create("histogram");
+
+    tcase_add_test(histogram_testcase, test_histogram_empty);
+    tcase_add_test(histogram_testcase, test_histogram_small_values);
+    tcase_add_test(histogram_testcase, test_histogram_precision);
+    tcase_add_test(histogram_testcase, test_histogram_huge_values);
+
+    suite_add_tcase(histogram_suite, histogram_testcase);
+
+    return histogram_suite;
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "test/test_suites.h"
+
+#include <check.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "input_device.h"
+
+static struct input_device device;
+static int uinput_pipe[2];
+
+/* Has the device write its reports to a pipe instead of to uinput */
+static void setup_device(void) {
+    ck_assert_int_eq(0, pipe(uinput_pipe));
+    ck_assert_int_eq(0, fcntl(uinput_pipe[0], F_SETFL, O_NONBLOCK));
+
+    device = (struct input_device) {
+        .uinput_fd = uinput_pipe[1],
+        .created = true,
+        .capabilities = DEVICE_PROFILE_FULL
+    };
+}
+
+static void teardown_device(void) {
+    close(uinput_pipe[0]);
+    close(uinput_pipe[1]);
+}
+
+/* Reads a single write() worth of events */
+static size_t read_report(struct input_event* events, size_t count) {
+    ssize_t res = read(uinput_pipe[0], events, count * sizeof(*events));
+    return res < 0 ? 0 : res / sizeof(*events);
+}
+
+static void assert_event(struct input_event* event, uint16_t type,
+        uint16_t code, int32_t value) {
+    ck_assert_uint_eq(event->type, type);
+    ck_assert_uint_eq(event->code, code);
+    ck_assert_int_eq(event->value, value);
+}
+
+START_TEST(test_device_parse_profile) {
+    unsigned int capabilities = 0;
+
+    ck_assert_int_eq(0, device_parse_profile("keyboard", &capabilities));
+    ck_assert_uint_eq(capabilities, DEVICE_PROFILE_KEYBOARD);
+
+    ck_assert_int_eq(0, device_parse_profile("mouse", &capabilities));
+    ck_assert_uint_eq(capabilities, DEVICE_PROFILE_MOUSE);
+
+    ck_assert_int_eq(0, device_parse_profile("full", &capabilities));
+    ck_assert_uint_eq(capabilities, DEVICE_PROFILE_FULL);
+} END_TEST
+
+START_TEST(test_device_parse_custom_profile) {
+    unsigned int capabilities = 0;
+
+    ck_assert_int_eq(0, device_parse_profile("keys,motion,", &capabilities));
+    ck_assert_uint_eq(capabilities, DEVICE_CAP_KEYBOARD | DEVICE_CAP_MOTION);
+
+    ck_assert_int_eq(0, device_parse_profile("keyboard,wheel", &capabilities));
+    ck_assert_uint_eq(capabilities, DEVICE_PROFILE_KEYBOARD | DEVICE_CAP_WHEEL);
+
+    /* Bad profiles leave the capabilities untouched */
+    ck_assert_int_eq(-1, device_parse_profile("keys,mice", &capabilities));
+    ck_assert_int_eq(-1, device_parse_profile("key", &capabilities));
+    ck_assert_int_eq(-1, device_parse_profile("", &capabilities));
+    ck_assert_uint_eq(capabilities, DEVICE_PROFILE_KEYBOARD | DEVICE_CAP_WHEEL);
+} END_TEST
+
+START_TEST(test_device_filters_redundant_keys) {
+    setup_device();
+
+    device_key_down(&device, KEY_A);
+    device_key_down(&device, KEY_A);
+    device_key_up(&device, KEY_B);
+    device_key_up(&device, KEY_A);
+    device_key_up(&device, KEY_A);
+
+    struct input_event events[4];
+    ck_assert_uint_eq(4, read_report(events, 4));
+    assert_event(&events[0], EV_KEY, KEY_A, 1);
+    assert_event(&events[1], EV_SYN, SYN_REPORT, 0);
+    assert_event(&events[2], EV_KEY, KEY_A, 0);
+    assert_event(&events[3], EV_SYN, SYN_REPORT, 0);
+    ck_assert_uint_eq(0, read_report(events, 4));
+
+    teardown_device();
+} END_TEST
+
+START_TEST(test_device_releases_all_keys_at_once) {
+    setup_device();
+
+    device_key_down(&device, KEY_LEFTSHIFT);
+    device_key_down(&device, KEY_A);
+    device_key_down(&device, BTN_LEFT);
+
+    struct input_event events[8];
+    ck_assert_uint_eq(6, read_report(events, 8));
+
+    device_release_all_keys(&device);
+
+    ck_assert_uint_eq(4, read_report(events, 8));
+    assert_event(&events[0], EV_KEY, KEY_A, 0);
+    assert_event(&events[1], EV_KEY, KEY_LEFTSHIFT, 0);
+    assert_event(&events[2], EV_KEY, BTN_LEFT, 0);
+    assert_event(&events[3], EV_SYN, SYN_REPORT, 0);
+
+    /* Nothing is left to release */
+    device_release_all_keys(&device);
+    ck_assert_uint_eq(0, read_report(events, 8));
+
+    teardown_device();
+} END_TEST
+
+START_TEST(test_device_sets_repeat) {
+    setup_device();
+
+    device_set_repeat(&device, 400, 50);
+
+    struct input_event events[4];
+    ck_assert_uint_eq(3, read_report(events, 4));
+    assert_event(&events[0], EV_REP, REP_DELAY, 400);
+    assert_event(&events[1], EV_REP, REP_PERIOD, 50);
+    assert_event(&events[2], EV_SYN, SYN_REPORT, 0);
+
+    /* Devices without key repeat ignore the setting */
+    device.capabilities = DEVICE_PROFILE_MOUSE;
+    device_set_repeat(&device, 400, 50);
+    ck_assert_uint_eq(0, read_report(events, 4));
+
+    teardown_device();
+} END_TEST
+
+START_TEST(test_device_queues_output_until_writable) {
+    setup_device();
+    ck_assert_int_eq(0, fcntl(uinput_pipe[1], F_SETFL, O_NONBLOCK));
+
+    /* Fill the pipe, so that writes fail with EAGAIN */
+    char filler[512] = { 0 };
+    size_t filled = 0;
+    ssize_t res;
+    while ((res = write(uinput_pipe[1], filler, sizeof(filler))) > 0) {
+        filled += res;
+    }
+
+    device_key_down(&device, KEY_A);
+    device_mouse_move(&device, 3, 0);
+    device_key_up(&device, KEY_A);
+
+    ck_assert(device_output_pending(&device));
+    ck_assert(!device_output_congested(&device));
+    ck_assert_uint_eq(device.stats.deferred, 3);
+    ck_assert_uint_eq(device.stats.max_depth, 6);
+
+    /* Still not writable */
+    device_flush_output(&device);
+    ck_assert(device_output_pending(&device));
+
+    while (filled > 0 && (res = read(uinput_pipe[0], filler,
+                    filled < sizeof(filler) ? filled : sizeof(filler))) > 0) {
+        filled -= res;
+    }
+
+    device_flush_output(&device);
+    ck_assert(!device_output_pending(&device));
+
+    struct input_event events[8];
+    ck_assert_uint_eq(6, read_report(events, 8));
+    assert_event(&events[0], EV_KEY, KEY_A, 1);
+    assert_event(&events[2], EV_REL, REL_X, 3);
+    assert_event(&events[4], EV_KEY, KEY_A, 0);
+    assert_event(&events[5], EV_SYN, SYN_REPORT, 0);
+    ck_assert_uint_eq(device.stats.dropped, 0);
+
+    teardown_device();
+} END_TEST
+
+START_TEST(test_device_keeps_room_for_keys) {
+    setup_device();
+    ck_assert_int_eq(0, fcntl(uinput_pipe[1], F_SETFL, O_NONBLOCK));
+
+    char filler[512] = { 0 };
+    while (write(uinput_pipe[1], filler, sizeof(filler)) > 0);
+
+    /* Motion fills the queue up to the room reserved for keys */
+    for (int i = 0; i < DEVICE_OUTPUT_QUEUE_SIZE; i++) {
+        device_mouse_move(&device, 1, 0);
+    }
+    ck_assert(device_output_congested(&device));
+    ck_assert_uint_gt(device.stats.dropped, 0);
+
+    uint64_t dropped = device.stats.dropped;
+    device_key_down(&device, KEY_A);
+    ck_assert_uint_eq(device.stats.dropped, dropped);
+
+    teardown_device();
+} END_TEST
+
+Suite* input_device_suite(void) {
+    Suite* input_device_suite = suite_create("input_device.c");
+
+    TCase* profile_testcase = tcase_create("profiles");
+
+    tcase_add_test(profile_testcase, test_device_parse_profile);
+    tcase_add_test(profile_testcase, test_device_parse_custom_profile);
+
+    TCase* keys_testcase = tcase_create("keys");
+
+    tcase_add_test(keys_testcase, test_device_filters_redundant_keys);
+    tcase_add_test(keys_testcase, test_device_releases_all_keys_at_once);
+    tcase_add_test(keys_testcase, test_device_sets_repeat);
+    tcase_add_test(keys_testcase, test_device_queues_output_until_writable);
+    tcase_add_test(keys_testcase, test_device_keeps_room_for_keys);
+
+    suite_add_tcase(input_device_suite, profile_testcase);
+    suite_add_tcase(input_device_suite, keys_testcase);
+
+    return input_device_suite;
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "test/test_suites.h"
+
+#include <check.h>
+#include <stdint.h>
+
+#include "jitter_buffer.h"
+#include "shared.h"
+
+static struct jitter_buffer buffer;
+
+static void push_event(uint16_t type, uint32_t time, uint32_t now) {
+    struct client_event event = { .type = type, .value = 1, .time = time };
+    ck_assert(jitter_buffer_push(&buffer, &event, now));
+}
+
+static void assert_pop(uint32_t now, uint16_t type) {
+    struct client_event event;
+    ck_assert(jitter_buffer_pop(&buffer, now, &event));
+    ck_assert_uint_eq(event.type, type);
+}
+
+static void assert_no_pop(uint32_t now) {
+    struct client_event event;
+    ck_assert(!jitter_buffer_pop(&buffer, now, &event));
+}
+
+START_TEST(test_jitter_buffer_keeps_spacing) {
+    jitter_buffer_init(&buffer, 5000);
+
+    /* With the client's clock 100000 us ahead, the quickest transit seen */
+    push_event(EV_MOUSE_DX, 100000, 0);
+    assert_pop(5000, EV_MOUSE_DX);
+
+    /* Captured 1 ms apart, arriving in a single clump */
+    push_event(EV_MOUSE_DX, 106000, 9000);
+    push_event(EV_MOUSE_DY, 107000, 9000);
+    push_event(EV_KEY_DOWN, 0, 9000);
+    push_event(EV_MOUSE_DX, 108000, 9000);
+
+    uint32_t due;
+    ck_assert(jitter_buffer_next_due(&buffer, &due));
+    ck_assert_uint_eq(due, 11000);
+
+    assert_no_pop(10999);
+    assert_pop(11000, EV_MOUSE_DX);
+    assert_no_pop(11999);
+    assert_pop(12000, EV_MOUSE_DY);
+    /* Untimed events go along with the event before them */
+    assert_pop(12000, EV_KEY_DOWN);
+    assert_no_pop(12999);
+    assert_pop(13000, EV_MOUSE_DX);
+    ck_assert(jitter_buffer_empty(&buffer));
+    ck_assert(!jitter_buffer_next_due(&buffer, &due));
+    ck_assert_uint_eq(buffer.stats.late, 0);
+} END_TEST
+
+START_TEST(test_jitter_buffer_adapts_delay) {
+    jitter_buffer_init(&buffer, 1000);
+
+    /* The delay grows to cover the spread of transit times, up to a point */
+    push_event(EV_MOUSE_DX, 1000, 1000);
+    push_event(EV_MOUSE_DX, 2000, 22000);
+    ck_assert_uint_eq(buffer.delay, 20000);
+    push_event(EV_MOUSE_DX, 3000, 203000);
+    ck_assert_uint_eq(buffer.delay, JITTER_BUFFER_MAX_DELAY_MS * 1000);
+    ck_assert_uint_eq(buffer.stats.late, 1);
+
+    /* It shrinks back gradually once the spread is forgotten */
+    uint32_t now = 203000 + 2 * JITTER_BUFFER_WINDOW_MS * 1000;
+    push_event(EV_MOUSE_DX, now, now);
+    ck_assert_uint_lt(buffer.delay, JITTER_BUFFER_MAX_DELAY_MS * 1000);
+    ck_assert_uint_gt(buffer.delay, 1000);
+} END_TEST
+
+START_TEST(test_jitter_buffer_holds_frames) {
+    jitter_buffer_init(&buffer, 1000);
+
+    push_event(EV_FRAME_BEGIN, 0, 1000);
+    push_event(EV_MOUSE_DX, 1000, 1000);
+
+    /* Nothing goes out until the frame is complete */
+    uint32_t due;
+    ck_assert(!jitter_buffer_next_due(&buffer, &due));
+    assert_no_pop(10000);
+
+    push_event(EV_MOUSE_DY, 0, 1500);
+    push_event(EV_FRAME_END, 0, 1500);
+
+    /* The frame goes out as a whole, when its timestamp is due */
+    ck_assert(jitter_buffer_next_due(&buffer, &due));
+    ck_assert_uint_eq(due, 2000);
+    assert_no_pop(1999);
+    assert_pop(2000, EV_FRAME_BEGIN);
+    assert_pop(2000, EV_MOUSE_DX);
+    assert_pop(2000, EV_MOUSE_DY);
+    assert_pop(2000, EV_FRAME_END);
+} END_TEST
+
+START_TEST(test_jitter_buffer_full) {
+    jitter_buffer_init(&buffer, 1000);
+
+    for (int i = 0; i < JITTER_BUFFER_SIZE; i++) {
+        push_event(EV_MOUSE_DX, 1000 + i, 1000);
+    }
+
+    struct client_event event = { .type = EV_MOUSE_DX, .time = 5000 };
+    ck_assert(!jitter_buffer_push(&buffer, &event, 1000));
+
+    jitter_buffer_shift(&buffer, &event);
+    ck_assert_uint_eq(event.time, 1000);
+    push_event(EV_MOUSE_DX, 5000, 1000);
+    ck_assert_uint_eq(buffer.length, JITTER_BUFFER_SIZE);
+} END_TEST
+
+START_TEST(test_jitter_buffer_wrap) {
+    jitter_buffer_init(&buffer, 1000);
+
+    /* The server's clock wraps while the event is held */
+    push_event(EV_KEY_DOWN, 5000, UINT32_MAX - 499);
+
+    assert_no_pop(UINT32_MAX);
+    assert_pop(500, EV_KEY_DOWN);
+} END_TEST
+
+Suite* jitter_buffer_suite(void) {
+    Suite* jitter_buffer_suite = suite_create("jitter_buffer.c");
+
+    TCase* jitter_buffer_testcase = tcase_create("jitter_buffer");
+
+    tcase_add_test(jitter_buffer_testcase, test_jitter_buffer_keeps_spacing);
+    tcase_add_test(jitter_buffer_testcase, test_jitter_buffer_adapts_delay);
+    tcase_add_test(jitter_buffer_testcase, test_jitter_buffer_holds_frames);
+    tcase_add_test(jitter_buffer_testcase, test_jitter_buffer_full);
+    tcase_add_test(jitter_buffer_testcase, test_jitter_buffer_wrap);
+
+    suite_add_tcase(jitter_buffer_suite, jitter_buffer_testcase);
+
+    return jitter_buffer_suite;
+}
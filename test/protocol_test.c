@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2017 Ingemar Ådahl
+ *
+ * This file is part of remote-input.
+ *
+ * remote-input is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * remote-input is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "test/test_suites.h"
+
+#include <check.h>
+#include <stdint.h>
+
+#include "protocol.h"
+#include "shared.h"
+
+static void assert_roundtrip(int version, uint16_t type, int32_t value,
+        size_t expected_size) {
+    uint8_t buffer[PROTOCOL_MAX_MSG_SIZE];
+    struct client_event event = { .type = type, .value = value };
+
+    size_t size = protocol_encode_event(version, &event, buffer);
+    ck_assert_uint_eq(size, expected_size);
+
+    struct client_event decoded;
+    ck_assert_int_eq(protocol_decode_event(version, buffer, size, &decoded),
+            size);
+    ck_assert_uint_eq(decoded.type, type);
+    ck_assert_int_eq(decoded.value, value);
+}
+
+START_TEST(test_v1_roundtrip) {
+    assert_roundtrip(PROTOCOL_V1, EV_KEY_DOWN, 30, EV_MSG_SIZE);
+    assert_roundtrip(PROTOCOL_V1, EV_MOUSE_DX, INT16_MIN, EV_MSG_SIZE);
+    assert_roundtrip(PROTOCOL_V1, EV_MOUSE_DY, INT16_MAX, EV_MSG_SIZE);
+} END_TEST
+
+START_TEST(test_v1_clamps_values) {
+    uint8_t buffer[PROTOCOL_MAX_MSG_SIZE];
+    struct client_event event = { .type = EV_MOUSE_DX, .value = 100000 };
+    protocol_encode_event(PROTOCOL_V1, &event, buffer);
+
+    struct client_event decoded;
+    protocol_decode_event(PROTOCOL_V1, buffer, EV_MSG_SIZE, &decoded);
+    ck_assert_int_eq(decoded.value, INT16_MAX);
+
+    event.value = -100000;
+    protocol_encode_event(PROTOCOL_V1, &event, buffer);
+    protocol_decode_event(PROTOCOL_V1, buffer, EV_MSG_SIZE, &decoded);
+    ck_assert_int_eq(decoded.value, INT16_MIN);
+} END_TEST
+
+START_TEST(test_v2_roundtrip) {
+    assert_roundtrip(PROTOCOL_V2, EV_FRAME_BEGIN, 0, 2);
+    assert_roundtrip(PROTOCOL_V2, EV_MOUSE_DX, -1, 2);
+    assert_roundtrip(PROTOCOL_V2, EV_MOUSE_DX, 63, 2);
+    assert_roundtrip(PROTOCOL_V2, EV_MOUSE_DY, -64, 2);
+    assert_roundtrip(PROTOCOL_V2, EV_MOUSE_DY, 64, 3);
+    assert_roundtrip(PROTOCOL_V2, EV_KEY_UP, 100000, 4);
+    assert_roundtrip(PROTOCOL_V2, EV_WHEEL, INT32_MAX, 6);
+    assert_roundtrip(PROTOCOL_V2, EV_WHEEL, INT32_MIN, 6);
+} END_TEST
+
+START_TEST(test_v2_incomplete) {
+    uint8_t buffer[PROTOCOL_MAX_MSG_SIZE];
+    struct client_event event = { .type = EV_MOUSE_DX, .value = 100000 };
+    size_t size = protocol_encode_event(PROTOCOL_V2, &event, buffer);
+
+    struct client_event decoded;
+    for (size_t i = 0; i < size; i++) {
+        ck_assert_int_eq(protocol_decode_event(PROTOCOL_V2, buffer, i,
+                    &decoded), 0);
+    }
+} END_TEST
+
+START_TEST(test_v2_malformed) {
+    const uint8_t buffer[] = {
+        EV_MOUSE_DX, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01
+    };
+
+    struct client_event decoded;
+    ck_assert_int_eq(protocol_decode_event(PROTOCOL_V2, buffer,
+                sizeof(buffer), &decoded), -1);
+} END_TEST
+
+START_TEST(test_datagram_header_roundtrip) {
+    struct datagram_header header = {
+        .seq = 0xfffffffe,
+        .key_seq = 42,
+        .key_count = 3
+    };
+
+    uint8_t buffer[DATAGRAM_HEADER_SIZE];
+    ck_assert_uint_eq(DATAGRAM_HEADER_SIZE,
+            protocol_encode_datagram_header(&header, buffer));
+
+    struct datagram_header decoded;
+    ck_assert_int_eq(-1, protocol_decode_datagram_header(buffer,
+                DATAGRAM_HEADER_SIZE - 1, &decoded));
+    ck_assert_int_eq(DATAGRAM_HEADER_SIZE, protocol_decode_datagram_header(
+                buffer, DATAGRAM_HEADER_SIZE, &decoded));
+    ck_assert_uint_eq(decoded.seq, header.seq);
+    ck_assert_uint_eq(decoded.key_seq, header.key_seq);
+    ck_assert_uint_eq(decoded.key_count, header.key_count);
+
+    /* Sequence numbers are compared across wraparound */
+    ck_assert(SEQ_AFTER(1, 0xfffffffe));
+    ck_assert(!SEQ_AFTER(0xfffffffe, 1));
+} END_TEST
+
+Suite* protocol_suite(void) {
+    Suite* protocol_suite = suite_create("protocol.c");
+    TCase* protocol_testcase = tcase_create("core");
+
+    suite_add_tcase(protocol_suite, protocol_testcase);
+    tcase_add_test(protocol_testcase, test_v1_roundtrip);
+    tcase_add_test(protocol_testcase, test_v1_clamps_values);
+    tcase_add_test(protocol_testcase, test_v2_roundtrip);
+    tcase_add_test(protocol_testcase, test_v2_incomplete);
+    tcase_add_test(protocol_testcase, test_v2_malformed);
+    tcase_add_test(protocol_testcase, test_datagram_header_roundtrip);
+
+    return protocol_suite;
+}
@@ -20,13 +20,19 @@
 
 #include <check.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 #include <sys/socket.h>
 
+#include "histogram.h"
 #include "logging.h"
+#include "protocol.h"
 #include "server.h"
+#include "shared.h"
 #include "test/socket_mock.h"
 
 struct server_info mock_server(int fd, const char* address, uint16_t port) {
@@ -85,6 +91,20 @@ START_TEST(test_server_accept_interrupt) {
     free_accept_responses();
 } END_TEST
 
+START_TEST(test_server_accept_eagain) {
+    int server_fd = 10;
+    int client_fd = -1;
+
+    struct server_info server = mock_server(server_fd, "localhost", 4000);
+    mock_accept_response(server.sv_fd, client_fd, "invalid", EAGAIN);
+
+    struct client_info client;
+    ck_assert_int_eq(-1, server_accept(&server, &client));
+    ck_assert_int_eq(client.cl_fd, client_fd);
+
+    free_accept_responses();
+} END_TEST
+
 START_TEST(test_server_accept_ebadf) {
     int server_fd = 9;
     int client_fd = -1;
@@ -103,6 +123,389 @@ START_TEST(test_server_accept_ebadf) {
     free_accept_responses();
 } END_TEST
 
+static struct client_info mock_client(int* peer_fd) {
+    int fds[2];
+    ck_assert_int_eq(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+    struct client_info client = {
+        .cl_fd = fds[0],
+        .cl_version = PROTOCOL_V1,
+        .cl_capabilities = 0,
+        .cl_buffer_start = 0,
+        .cl_buffer_end = 0,
+        .cl_send_length = 0
+    };
+    *peer_fd = fds[1];
+
+    return client;
+}
+
+static void encode_event(uint8_t* event_buffer, uint16_t type, int16_t value) {
+    EV_MSG_FIELD(event_buffer, type) = htons(type);
+    EV_MSG_FIELD(event_buffer, value) = htons(value);
+}
+
+START_TEST(test_read_client_event_batch) {
+    int peer_fd;
+    struct client_info client = mock_client(&peer_fd);
+
+    uint8_t events[3][EV_MSG_SIZE];
+    encode_event(events[0], EV_KEY_DOWN, 30);
+    encode_event(events[1], EV_MOUSE_DX, -12);
+    encode_event(events[2], EV_KEY_UP, 30);
+    ck_assert_int_eq(sizeof(events), write(peer_fd, events, sizeof(events)));
+
+    ck_assert_int_eq(sizeof(events), receive_client_data(&client));
+
+    struct client_event event;
+    ck_assert_int_eq(1, next_client_event(&client, &event));
+    ck_assert_uint_eq(event.type, EV_KEY_DOWN);
+    ck_assert_int_eq(event.value, 30);
+    ck_assert_int_eq(1, next_client_event(&client, &event));
+    ck_assert_uint_eq(event.type, EV_MOUSE_DX);
+    ck_assert_int_eq(event.value, -12);
+    ck_assert_int_eq(1, next_client_event(&client, &event));
+    ck_assert_uint_eq(event.type, EV_KEY_UP);
+    ck_assert_int_eq(event.value, 30);
+    ck_assert_int_eq(0, next_client_event(&client, &event));
+
+    close(peer_fd);
+    close(client.cl_fd);
+} END_TEST
+
+START_TEST(test_read_client_event_partial) {
+    int peer_fd;
+    struct client_info client = mock_client(&peer_fd);
+
+    uint8_t events[2 * EV_MSG_SIZE];
+    encode_event(&events[0], EV_MOUSE_DY, 1000);
+    encode_event(&events[EV_MSG_SIZE], EV_WHEEL, -1);
+
+    /* Split the first message over two reads */
+    ck_assert_int_eq(3, write(peer_fd, events, 3));
+    ck_assert_int_eq(3, receive_client_data(&client));
+
+    struct client_event event;
+    ck_assert_int_eq(0, next_client_event(&client, &event));
+
+    ck_assert_int_eq(5, write(peer_fd, &events[3], 5));
+    ck_assert_int_eq(1, read_client_event(&client, &event));
+    ck_assert_uint_eq(event.type, EV_MOUSE_DY);
+    ck_assert_int_eq(event.value, 1000);
+    ck_assert_int_eq(1, read_client_event(&client, &event));
+    ck_assert_uint_eq(event.type, EV_WHEEL);
+    ck_assert_int_eq(event.value, -1);
+
+    close(peer_fd);
+    close(client.cl_fd);
+} END_TEST
+
+START_TEST(test_read_client_event_disconnect) {
+    int peer_fd;
+    struct client_info client = mock_client(&peer_fd);
+
+    /* A message cut short by a disconnect is discarded */
+    uint8_t event_buffer[EV_MSG_SIZE];
+    encode_event(event_buffer, EV_KEY_DOWN, 42);
+    ck_assert_int_eq(2, write(peer_fd, event_buffer, 2));
+    close(peer_fd);
+
+    struct client_event event;
+    ck_assert_int_eq(0, read_client_event(&client, &event));
+
+    close(client.cl_fd);
+} END_TEST
+
+START_TEST(test_read_client_event_handshake) {
+    int peer_fd;
+    struct client_info client = mock_client(&peer_fd);
+
+    const struct client_event request[] = {
+        { .type = EV_CAPABILITIES, .value = 0xffff },
+        { .type = EV_HELLO, .value = PROTOCOL_V2 + 1 },
+        { .type = EV_HELLO, .value = PROTOCOL_V2 },
+        { .type = EV_MOUSE_DX, .value = 100000 }
+    };
+
+    uint8_t request_buffer[4 * PROTOCOL_MAX_MSG_SIZE];
+    size_t request_size = 0;
+    for (size_t i = 0; i < 3; i++) {
+        request_size += protocol_encode_event(PROTOCOL_V1, &request[i],
+                &request_buffer[request_size]);
+    }
+    request_size += protocol_encode_event(PROTOCOL_V2, &request[3],
+            &request_buffer[request_size]);
+    ck_assert_int_eq(request_size, write(peer_fd, request_buffer,
+                request_size));
+
+    /* The handshake is answered and consumed, and the data following the
+     * acknowledgement is decoded using the negotiated version */
+    struct client_event event;
+    ck_assert_int_eq(1, read_client_event(&client, &event));
+    ck_assert_uint_eq(event.type, EV_MOUSE_DX);
+    ck_assert_int_eq(event.value, 100000);
+    ck_assert_int_eq(client.cl_version, PROTOCOL_V2);
+    ck_assert_uint_eq(client.cl_capabilities, PROTOCOL_CAPABILITIES);
+
+    uint8_t reply[2 * EV_MSG_SIZE];
+    ck_assert_int_eq(sizeof(reply), read(peer_fd, reply, sizeof(reply)));
+
+    struct client_event reply_event;
+    protocol_decode_event(PROTOCOL_V1, &reply[0], EV_MSG_SIZE, &reply_event);
+    ck_assert_uint_eq(reply_event.type, EV_CAPABILITIES);
+    ck_assert_int_eq(reply_event.value, PROTOCOL_CAPABILITIES);
+    protocol_decode_event(PROTOCOL_V1, &reply[EV_MSG_SIZE], EV_MSG_SIZE,
+            &reply_event);
+    ck_assert_uint_eq(reply_event.type, EV_HELLO);
+    ck_assert_int_eq(reply_event.value, PROTOCOL_V2);
+
+    close(peer_fd);
+    close(client.cl_fd);
+} END_TEST
+
+START_TEST(test_read_client_event_handshake_unacknowledged) {
+    int peer_fd;
+    struct client_info client = mock_client(&peer_fd);
+
+    /* A client giving up on the answer carries on with version 1 */
+    const struct client_event request[] = {
+        { .type = EV_CAPABILITIES, .value = 0xffff },
+        { .type = EV_HELLO, .value = PROTOCOL_V2 },
+        { .type = EV_MOUSE_DX, .value = -100 }
+    };
+
+    uint8_t request_buffer[3 * EV_MSG_SIZE];
+    for (size_t i = 0; i < 3; i++) {
+        protocol_encode_event(PROTOCOL_V1, &request[i],
+                &request_buffer[i * EV_MSG_SIZE]);
+    }
+    ck_assert_int_eq(sizeof(request_buffer), write(peer_fd, request_buffer,
+                sizeof(request_buffer)));
+
+    struct client_event event;
+    ck_assert_int_eq(1, read_client_event(&client, &event));
+    ck_assert_uint_eq(event.type, EV_MOUSE_DX);
+    ck_assert_int_eq(event.value, -100);
+    ck_assert_int_eq(client.cl_version, PROTOCOL_V1);
+    ck_assert_uint_eq(client.cl_capabilities, 0);
+
+    close(peer_fd);
+    close(client.cl_fd);
+} END_TEST
+
+START_TEST(test_read_client_event_timestamps) {
+    int peer_fd;
+    struct client_info client = mock_client(&peer_fd);
+    client.cl_version = PROTOCOL_V2;
+    client.cl_capabilities = PROTOCOL_CAP_TIMESTAMPS;
+    struct histogram round_trips;
+    histogram_init(&round_trips);
+    client.cl_round_trips = &round_trips;
+
+    ck_assert_int_eq(0, ping_client(&client));
+
+    uint8_t ping_buffer[PROTOCOL_MAX_MSG_SIZE];
+    ssize_t ping_size = read(peer_fd, ping_buffer, sizeof(ping_buffer));
+    struct client_event ping;
+    ck_assert_int_eq(ping_size, protocol_decode_event(PROTOCOL_V2,
+                ping_buffer, ping_size, &ping));
+    ck_assert_uint_eq(ping.type, EV_PING);
+
+    /* The client's clock is 5000 us ahead */
+    uint32_t pinged = ping.value;
+    const struct client_event reply[] = {
+        { .type = EV_TIMESTAMP, .value = pinged + 5000 },
+        { .type = EV_PONG, .value = pinged },
+        { .type = EV_TIMESTAMP, .value = 12345 },
+        { .type = EV_KEY_DOWN, .value = 30 },
+        { .type = EV_KEY_UP, .value = 30 }
+    };
+
+    uint8_t reply_buffer[5 * PROTOCOL_MAX_MSG_SIZE];
+    size_t reply_size = 0;
+    for (size_t i = 0; i < sizeof(reply) / sizeof(reply[0]); i++) {
+        reply_size += protocol_encode_event(PROTOCOL_V2, &reply[i],
+                &reply_buffer[reply_size]);
+    }
+    ck_assert_int_eq(reply_size, write(peer_fd, reply_buffer, reply_size));
+
+    /* Timestamps only go with the event following them */
+    struct client_event event;
+    ck_assert_int_eq(1, read_client_event(&client, &event));
+    ck_assert_uint_eq(event.type, EV_KEY_DOWN);
+    ck_assert_uint_eq(event.time, 12345);
+    ck_assert_int_eq(1, read_client_event(&client, &event));
+    ck_assert_uint_eq(event.type, EV_KEY_UP);
+    ck_assert_uint_eq(event.time, 0);
+
+    uint32_t local;
+    ck_assert_int_eq(0, clock_sync_to_local(&client.cl_clock, pinged + 5000,
+                &local));
+    ck_assert_int_ge((int32_t)(local - pinged), 0);
+    ck_assert_int_le((int32_t)(local - pinged),
+            clock_sync_round_trip(&client.cl_clock));
+    ck_assert_uint_eq(round_trips.total, 1);
+
+    close(peer_fd);
+    close(client.cl_fd);
+} END_TEST
+
+START_TEST(test_ping_client_backed_up) {
+    int peer_fd;
+    struct client_info client = mock_client(&peer_fd);
+    client.cl_version = PROTOCOL_V2;
+    client.cl_capabilities = PROTOCOL_CAP_TIMESTAMPS;
+    ck_assert_int_eq(0, fcntl(client.cl_fd, F_SETFL, O_NONBLOCK));
+
+    /* Fill the socket up, as a client not reading would */
+    uint8_t junk[4096] = { 0 };
+    size_t filled = 0;
+    for (size_t chunk = sizeof(junk); chunk > 0; chunk /= 2) {
+        ssize_t written;
+        while ((written = write(client.cl_fd, junk, chunk)) > 0) {
+            filled += written;
+        }
+        ck_assert(errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+
+    /* The ping waits in the send buffer, and no more are queued behind it */
+    ck_assert_int_eq(0, ping_client(&client));
+    size_t pending = client.cl_send_length;
+    ck_assert_uint_gt(pending, 0);
+    ck_assert_int_eq(0, ping_client(&client));
+    ck_assert_uint_eq(client.cl_send_length, pending);
+
+    while (filled > 0) {
+        ssize_t length = read(peer_fd, junk,
+                filled < sizeof(junk) ? filled : sizeof(junk));
+        ck_assert_int_gt(length, 0);
+        filled -= length;
+    }
+
+    ck_assert_int_eq(0, flush_client(&client));
+    ck_assert_uint_eq(client.cl_send_length, 0);
+
+    uint8_t ping_buffer[PROTOCOL_MAX_MSG_SIZE];
+    ssize_t ping_size = read(peer_fd, ping_buffer, sizeof(ping_buffer));
+    struct client_event ping;
+    ck_assert_int_eq(ping_size, protocol_decode_event(PROTOCOL_V2,
+                ping_buffer, ping_size, &ping));
+    ck_assert_uint_eq(ping.type, EV_PING);
+
+    close(peer_fd);
+    close(client.cl_fd);
+} END_TEST
+
+static void mock_datagram(struct datagram* datagram, uint32_t seq,
+        uint32_t key_seq, const struct client_event* events,
+        size_t key_count, size_t event_count) {
+    struct datagram_header header = {
+        .seq = seq,
+        .key_seq = key_seq,
+        .key_count = key_count
+    };
+
+    datagram->dg_sockaddr_len = sizeof(struct sockaddr_in);
+    memset(&datagram->dg_sockaddr, 0, sizeof(datagram->dg_sockaddr));
+    datagram->dg_sockaddr.ss_family = AF_INET;
+
+    datagram->dg_length = protocol_encode_datagram_header(&header,
+            datagram->dg_data);
+    for (size_t i = 0; i < event_count; i++) {
+        datagram->dg_length += protocol_encode_event(PROTOCOL_V2, &events[i],
+                &datagram->dg_data[datagram->dg_length]);
+    }
+}
+
+START_TEST(test_decode_datagram_retransmission) {
+    const struct client_event sent[] = {
+        { .type = EV_KEY_DOWN, .value = 30 },
+        { .type = EV_KEY_UP, .value = 30 },
+        { .type = EV_POINTER_X, .value = 5 },
+        { .type = EV_POINTER_Y, .value = 0 }
+    };
+
+    struct datagram datagram;
+    struct datagram_peer peer;
+    struct client_event events[DATAGRAM_MAX_EVENTS];
+
+    mock_datagram(&datagram, 100, 0, sent, 1, 1);
+    datagram_peer_init(&peer, &datagram);
+    ck_assert(datagram_from_peer(&datagram, &peer));
+
+    ck_assert_int_eq(1, decode_datagram(&peer, &datagram, events));
+    ck_assert_uint_eq(events[0].type, EV_KEY_DOWN);
+    ck_assert_int_eq(events[0].value, 30);
+
+    /* The unacknowledged key down is repeated along with the key up */
+    mock_datagram(&datagram, 101, 0, sent, 2, 4);
+    ck_assert_int_eq(4, decode_datagram(&peer, &datagram, events));
+    ck_assert_uint_eq(events[0].type, EV_KEY_UP);
+    ck_assert_uint_eq(events[1].type, EV_FRAME_BEGIN);
+    ck_assert_uint_eq(events[2].type, EV_MOUSE_DX);
+    ck_assert_int_eq(events[2].value, 5);
+    ck_assert_uint_eq(events[3].type, EV_FRAME_END);
+    ck_assert_uint_eq(peer.dp_next_key_seq, 2);
+} END_TEST
+
+START_TEST(test_decode_datagram_too_many_keys) {
+    struct client_event sent[DATAGRAM_MAX_RELIABLE_EVENTS + 1];
+    for (size_t i = 0; i < DATAGRAM_MAX_RELIABLE_EVENTS + 1; i++) {
+        sent[i] = (struct client_event) { .type = EV_KEY_DOWN, .value = 30 };
+    }
+
+    struct datagram datagram;
+    struct datagram_peer peer;
+    struct client_event events[DATAGRAM_MAX_EVENTS];
+
+    mock_datagram(&datagram, 100, 0, sent, DATAGRAM_MAX_RELIABLE_EVENTS + 1,
+            DATAGRAM_MAX_RELIABLE_EVENTS + 1);
+    datagram_peer_init(&peer, &datagram);
+    ck_assert_int_eq(-1, decode_datagram(&peer, &datagram, events));
+    ck_assert_uint_eq(peer.dp_next_key_seq, 0);
+
+    /* Claiming more events than the datagram holds, key_count being the last
+     * byte of the header */
+    mock_datagram(&datagram, 101, 0, sent, 2, 2);
+    datagram.dg_data[DATAGRAM_HEADER_SIZE - 1] = DATAGRAM_MAX_RELIABLE_EVENTS;
+    ck_assert_int_eq(-1, decode_datagram(&peer, &datagram, events));
+    ck_assert_uint_eq(peer.dp_next_key_seq, 0);
+} END_TEST
+
+START_TEST(test_decode_datagram_motion) {
+    const struct client_event first[] = {
+        { .type = EV_POINTER_X, .value = 10 },
+        { .type = EV_POINTER_Y, .value = -3 }
+    };
+    const struct client_event second[] = {
+        { .type = EV_POINTER_X, .value = 25 },
+        { .type = EV_POINTER_Y, .value = -3 }
+    };
+
+    struct datagram datagram;
+    struct datagram_peer peer;
+    struct client_event events[DATAGRAM_MAX_EVENTS];
+
+    mock_datagram(&datagram, 7, 0, first, 0, 2);
+    datagram_peer_init(&peer, &datagram);
+
+    /* The second datagram overtakes the first one */
+    mock_datagram(&datagram, 8, 0, second, 0, 2);
+    ck_assert_int_eq(4, decode_datagram(&peer, &datagram, events));
+    ck_assert_uint_eq(events[1].type, EV_MOUSE_DX);
+    ck_assert_int_eq(events[1].value, 25);
+    ck_assert_uint_eq(events[2].type, EV_MOUSE_DY);
+    ck_assert_int_eq(events[2].value, -3);
+
+    mock_datagram(&datagram, 7, 0, first, 0, 2);
+    ck_assert_int_eq(0, decode_datagram(&peer, &datagram, events));
+
+    /* Truncated events are rejected */
+    mock_datagram(&datagram, 9, 0, second, 0, 2);
+    datagram.dg_length--;
+    ck_assert_int_eq(-1, decode_datagram(&peer, &datagram, events));
+} END_TEST
+
 Suite* server_suite(void) {
     Suite* server_suite = suite_create("server.c");
     TCase* server_testcase = tcase_create("core");
@@ -111,7 +514,19 @@ Suite* server_suite(void) {
     tcase_add_test(server_testcase, test_server_accept_ipv4);
     tcase_add_test(server_testcase, test_server_accept_ipv6);
     tcase_add_test(server_testcase, test_server_accept_interrupt);
+    tcase_add_test(server_testcase, test_server_accept_eagain);
     tcase_add_test(server_testcase, test_server_accept_ebadf);
+    tcase_add_test(server_testcase, test_read_client_event_batch);
+    tcase_add_test(server_testcase, test_read_client_event_partial);
+    tcase_add_test(server_testcase, test_read_client_event_disconnect);
+    tcase_add_test(server_testcase, test_read_client_event_handshake);
+    tcase_add_test(server_testcase,
+            test_read_client_event_handshake_unacknowledged);
+    tcase_add_test(server_testcase, test_read_client_event_timestamps);
+    tcase_add_test(server_testcase, test_ping_client_backed_up);
+    tcase_add_test(server_testcase, test_decode_datagram_retransmission);
+    tcase_add_test(server_testcase, test_decode_datagram_too_many_keys);
+    tcase_add_test(server_testcase, test_decode_datagram_motion);
 
     return server_suite;
 }
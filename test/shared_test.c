@@ -20,6 +20,7 @@
 
 #include <check.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "shared.h"
 
@@ -51,6 +52,18 @@ START_TEST(test_macro_noclobber) {
     ck_assert_int_eq(EV_MSG_FIELD(event[2], value), 0x0);
 } END_TEST
 
+START_TEST(test_elapsed_ns) {
+    struct timespec since = { .tv_sec = 10, .tv_nsec = 900000000 };
+    struct timespec until = { .tv_sec = 12, .tv_nsec = 100000000 };
+
+    ck_assert_uint_eq(elapsed_ns(&since, &until), 1200000000);
+    ck_assert_uint_eq(elapsed_ns(&until, &since), 0);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ck_assert_uint_lt(elapsed_ns(&now, NULL), 1000000000);
+} END_TEST
+
 Suite* shared_suite(void) {
     Suite* shared_suite = suite_create("shared.h");
     TCase* shared_testcase = tcase_create("core");
@@ -58,6 +71,7 @@ Suite* shared_suite(void) {
     suite_add_tcase(shared_suite, shared_testcase);
     tcase_add_test(shared_testcase, test_macro_write_read);
     tcase_add_test(shared_testcase, test_macro_noclobber);
+    tcase_add_test(shared_testcase, test_elapsed_ns);
 
     return shared_suite;
 }
@@ -41,6 +41,13 @@ pid_t tracer_pid(void) {
 int main(int argc, char* argv[]) {
     SRunner* runner = srunner_create(server_suite());
     srunner_add_suite(runner, shared_suite());
+    srunner_add_suite(runner, protocol_suite());
+    srunner_add_suite(runner, event_ring_suite());
+    srunner_add_suite(runner, connection_suite());
+    srunner_add_suite(runner, input_device_suite());
+    srunner_add_suite(runner, histogram_suite());
+    srunner_add_suite(runner, clock_sync_suite());
+    srunner_add_suite(runner, jitter_buffer_suite());
 
     if (tracer_pid() > 0) {
         printf("Debugger detected, disabling test forking.\n");
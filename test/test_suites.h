@@ -19,6 +19,13 @@
 #ifndef _TEST_TEST_SUITES_H_
 #define _TEST_TEST_SUITES_H_
 
+struct Suite* clock_sync_suite(void);
+struct Suite* connection_suite(void);
+struct Suite* event_ring_suite(void);
+struct Suite* histogram_suite(void);
+struct Suite* input_device_suite(void);
+struct Suite* jitter_buffer_suite(void);
+struct Suite* protocol_suite(void);
 struct Suite* server_suite(void);
 struct Suite* shared_suite(void);
 
@@ -16,32 +16,38 @@
  * You should have received a copy of the GNU General Public License
  * along with remote-input.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <getopt.h>
-#include <netdb.h>
-#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 #include <X11/X.h>
 #include <X11/Xlib.h>
 #include <X11/XKBlib.h>
 #include <X11/keysym.h>
-#include <sys/socket.h>
+#ifdef HAVE_XI2
+#include <X11/extensions/XInput2.h>
+#endif
 
+#include "connection.h"
 #include "keysym_to_linux_code.h"
+#include "protocol.h"
+#include "sender.h"
 #include "shared.h"
+#include "socket_profile.h"
 
 #define DEFAULT_SERVER_PORT_STR "4004"
+#define DEFAULT_MOTION_RATE 1000
 
 static const uint32_t abort_key = XK_Tab;
 static const uint32_t abort_mask = ShiftMask | ControlMask;
 
-/*
- * TODO: SIGPIPE when remote closed
- */
-
 struct point {
     uint16_t x;
     uint16_t y;
@@ -52,15 +58,56 @@ struct size {
     uint16_t height;
 };
 
+/* Looked up once before grabbing, so that handling key events never has to
+ * wait for the X server */
+struct keyboard_info {
+    KeyCode abort_keycode;
+    XModifierKeymap* modifier_map;
+};
+
 struct pointer_info {
     struct point original_position;
     struct point reset_position;
 };
 
+/* Pointer motion gathered from MotionNotify events, sent once per tick */
+struct motion {
+    int32_t dx;
+    int32_t dy;
+    struct timespec last_sent;
+    /* Capture time of the first motion gathered */
+    uint32_t captured;
+
+    /* Fractions of raw motion left over from what has been sent */
+    double remainder_x;
+    double remainder_y;
+
+    /* Pointer position as of the last MotionNotify handled */
+    struct point position;
+    /* Set until events generated after the warp with serial warp_serial back
+     * to the reset position start arriving */
+    bool warp_pending;
+    unsigned long warp_serial;
+};
+
+/* Maps X server time, in milliseconds of a clock of its own, to protocol
+ * timestamps */
+struct capture_clock {
+    bool anchored;
+    /* Protocol timestamp minus X server time in microseconds */
+    uint32_t offset;
+};
+
 struct args {
     bool verbose;
     bool quiet;
     bool use_keymap;
+    bool datagrams;
+    bool raw_input;
+    int motion_rate;
+    bool low_latency;
+    int dscp;
+    int protocol_version;
     char* server_host;
     char* server_port;
 };
@@ -69,19 +116,24 @@ static const struct args argument_defaults = {
     .verbose = false,
     .quiet = false,
     .use_keymap = false,
+    .datagrams = false,
+    .raw_input = false,
+    .motion_rate = DEFAULT_MOTION_RATE,
+    .low_latency = true,
+    .dscp = DSCP_EF,
+    .protocol_version = PROTOCOL_VERSION,
     .server_host = NULL,
     .server_port = DEFAULT_SERVER_PORT_STR
 };
 
 static struct size get_screen_size(Display* display) {
-    Window root_window = DefaultRootWindow(display);
-
-    XWindowAttributes attributes;
-    XGetWindowAttributes(display, root_window, &attributes);
+    /* Known since connecting, unlike XGetWindowAttributes() which waits for a
+     * reply */
+    int screen = DefaultScreen(display);
 
     return (struct size) {
-        .width = attributes.width,
-        .height = attributes.height
+        .width = DisplayWidth(display, screen),
+        .height = DisplayHeight(display, screen)
     };
 }
 
@@ -118,7 +170,8 @@ static void reset_pointer(Display* display, struct point* reset_position) {
             reset_position->x, reset_position->y);
 }
 
-static int32_t grab_and_hide_root_window_pointer(Display* display) {
+static int32_t grab_and_hide_root_window_pointer(Display* display,
+        uint32_t pointer_event_mask) {
     Window root_window = DefaultRootWindow(display);
 
     /* Replace the cursor with an invisible bitmap to "hide" it */
@@ -130,9 +183,6 @@ static int32_t grab_and_hide_root_window_pointer(Display* display) {
     Cursor cursor = XCreatePixmapCursor(display, cursor_pixmap, cursor_pixmap,
             &xcolor, &xcolor, 1, 1);
 
-    uint32_t pointer_event_mask =
-        PointerMotionMask | ButtonPressMask | ButtonReleaseMask;
-
     int32_t grab_result =XGrabPointer(display, root_window, True,
             pointer_event_mask, GrabModeAsync, GrabModeAsync, root_window,
             cursor, CurrentTime);
@@ -155,7 +205,7 @@ static int32_t grab_and_hide_root_window_pointer(Display* display) {
 }
 
 static int32_t lock_pointer(Display* display,
-        struct pointer_info* pointer_info) {
+        struct pointer_info* pointer_info, uint32_t pointer_event_mask) {
     Window root_window = DefaultRootWindow(display);
 
     Window pointer_root_w, pointer_child_w;
@@ -169,7 +219,8 @@ static int32_t lock_pointer(Display* display,
     pointer_info->original_position.x = root_x;
     pointer_info->original_position.y = root_y;
 
-    int32_t grab_result = grab_and_hide_root_window_pointer(display);
+    int32_t grab_result = grab_and_hide_root_window_pointer(display,
+            pointer_event_mask);
     if (grab_result != GrabSuccess) {
         return grab_result;
     }
@@ -195,81 +246,65 @@ static void release_pointer(Display* display, struct point* original_position) {
     XUngrabPointer(display, CurrentTime);
 }
 
-static bool consume_autorepeat_event(Display* display, XEvent* event) {
-    if (XEventsQueued(display, QueuedAfterReading)) {
-        XEvent next_event;
-        XPeekEvent(display, &next_event);
+/* Keeps track of the keys held down, returning true for key presses which
+ * are repeats. With detectable autorepeat, the X server repeats a held key as
+ * presses without releases in between, which are left for the target's
+ * kernel to generate instead of being sent.
+ */
+static bool is_key_repeat(uint8_t* pressed_keys, const XKeyEvent* event) {
+    uint8_t bit = 1 << (event->keycode % 8);
+    uint8_t* keys = &pressed_keys[event->keycode / 8];
 
-        if (next_event.type == KeyPress &&
-                next_event.xkey.time == event->xkey.time &&
-                next_event.xkey.keycode == event->xkey.keycode) {
-            XNextEvent(display, event);
-            return true;
-        }
+    if (event->type == KeyRelease) {
+        *keys &= ~bit;
+        return false;
     }
 
-    return false;
+    bool repeat = *keys & bit;
+    *keys |= bit;
+    return repeat;
 }
 
-static int connect_to_server(const char* host, const char* service) {
-    struct addrinfo connection_hints = {
-        .ai_family = AF_UNSPEC,
-        .ai_socktype = SOCK_STREAM,
-    };
-
-    struct addrinfo* server_addrs;
-    int addr_res = getaddrinfo(host, service, &connection_hints, &server_addrs);
-    if (addr_res != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(addr_res));
-        return -1;
-    }
-
-    int socket_fd = -1;
-    struct addrinfo* addr;
-    for (addr = server_addrs; addr != NULL; addr = addr->ai_next) {
-        if ((socket_fd = socket(addr->ai_family, addr->ai_socktype,
-                addr->ai_protocol)) < 0) {
-            continue;
-        }
-
-        if (connect(socket_fd, addr->ai_addr, addr->ai_addrlen) == 0)
-            break;
-
-        close(socket_fd);
-    }
-
-    freeaddrinfo(server_addrs);
-
-    if (addr == NULL) {
-        return -1;
-    }
-
-    return socket_fd;
+static void flush_events(Display* display) {
+    XEvent e;
+    while (XPending(display)) XNextEvent(display, &e);
 }
 
-static void write_client_event(int connection,
-        struct client_event* client_event) {
-    uint8_t event_buffer[EV_MSG_SIZE];
-
-    EV_MSG_FIELD(event_buffer, type) = htons(client_event->type);
-    EV_MSG_FIELD(event_buffer, value) = htons(client_event->value);
-
-    write(connection, event_buffer, sizeof(event_buffer));
+static void get_keyboard_info(Display* display,
+        struct keyboard_info* keyboard_info) {
+    keyboard_info->abort_keycode = XKeysymToKeycode(display, abort_key);
+    keyboard_info->modifier_map = XGetModifierMapping(display);
 }
 
-static void flush_events(Display* display) {
-    XEvent e;
-    while (XPending(display)) XNextEvent(display, &e);
+static bool is_quit_combination(const struct keyboard_info* keyboard_info,
+        XKeyEvent* event) {
+    return event->keycode == keyboard_info->abort_keycode &&
+        (event->state & abort_mask) == abort_mask;
 }
 
-static bool is_quit_combination(Display* display, XKeyEvent* event) {
-    KeySym keysym = XkbKeycodeToKeysym(display, event->keycode, 0, 0);
-    return keysym == abort_key && (event->state & abort_mask) == abort_mask;
+/* Returns the capture time of an event with X server time time. Events are
+ * handled some time after being captured, so the smallest difference between
+ * the two clocks seen so far is the one closest to the truth.
+ */
+static uint32_t capture_time(struct capture_clock* clock, Time time) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    /* X server time wraps after 2^32 ms, a whole number of 2^32 us */
+    uint32_t offset = protocol_timestamp(&now) - (uint32_t)time * 1000;
+    if (!clock->anchored || (int32_t)(offset - clock->offset) < 0) {
+        clock->offset = offset;
+        clock->anchored = true;
+    }
+
+    /* Zero means unknown */
+    uint32_t captured = (uint32_t)time * 1000 + clock->offset;
+    return captured != 0 ? captured : 1;
 }
 
 static void forward_key_button_event(Display* display, XEvent* event,
-        int connection, struct args args) {
-    struct client_event cl_event;
+        uint32_t captured, struct sender* sender, struct args args) {
+    struct client_event cl_event = { .time = captured };
 
     switch (event->type) {
         case KeyPress:
@@ -351,7 +386,40 @@ static void forward_key_button_event(Display* display, XEvent* event,
         }
     }
 
-    write_client_event(connection, &cl_event);
+    sender_queue_event(sender, &cl_event);
+}
+
+static void forward_motion(struct sender* sender, int32_t dx,
+        int32_t dy, uint32_t captured) {
+    /* Moving along both axes is sent as a single frame, so that it's reported
+     * as one diagonal step rather than a horizontal and a vertical one */
+    bool is_frame = dx != 0 && dy != 0 &&
+        (sender->connection->capabilities & PROTOCOL_CAP_FRAMES);
+    struct client_event event = { .time = captured };
+
+    if (is_frame) {
+        event.type = EV_FRAME_BEGIN;
+        event.value = 0;
+        sender_queue_event(sender, &event);
+    }
+
+    if (dx != 0) {
+        event.type = EV_MOUSE_DX;
+        event.value = dx;
+        sender_queue_event(sender, &event);
+    }
+
+    if (dy != 0) {
+        event.type = EV_MOUSE_DY;
+        event.value = dy;
+        sender_queue_event(sender, &event);
+    }
+
+    if (is_frame) {
+        event.type = EV_FRAME_END;
+        event.value = 0;
+        sender_queue_event(sender, &event);
+    }
 }
 
 static void usage(const char* program_name) {
@@ -359,6 +427,22 @@ static void usage(const char* program_name) {
     puts("\nOptions:\n"
             "  -m  --use-keymap     translate key presses using the X keymap "
             "table\n"
+            "  -P  --protocol N     highest protocol version to use (1 or 2, "
+            "defaults to 2)\n"
+            "  -r  --rate HZ        highest rate to send pointer motion at "
+            "(defaults to\n"
+            "                       1000, 0 sends motion as soon as it "
+            "arrives)\n"
+            "  -R  --raw            read unaccelerated input through XInput2, "
+            "without\n"
+            "                       warping the pointer\n"
+            "  -u  --udp            send events over UDP, retransmitting key "
+            "events\n"
+            "  -D  --dscp N         DSCP class to mark traffic with (defaults "
+            "to 46, 0\n"
+            "                       for none)\n"
+            "  -N  --no-low-latency leave socket options at the system "
+            "defaults\n"
             "  -v  --verbose        write emitted events to stdout\n"
             "  -q  --quiet          suppress informative messages\n"
             "  -h  --help           show this help text and exit");
@@ -368,6 +452,12 @@ static struct args parse_args(int argc, char* argv[]) {
     struct args args = argument_defaults;
 
     struct option const long_options[] = {
+        {"protocol", required_argument, NULL, 'P'},
+        {"rate", required_argument, NULL, 'r'},
+        {"raw", no_argument, NULL, 'R'},
+        {"udp", no_argument, NULL, 'u'},
+        {"dscp", required_argument, NULL, 'D'},
+        {"no-low-latency", no_argument, NULL, 'N'},
         {"verbose", no_argument, NULL, 'v'},
         {"quiet", no_argument, NULL, 'q'},
         {"help", no_argument, NULL, 'h'},
@@ -376,8 +466,45 @@ static struct args parse_args(int argc, char* argv[]) {
     };
 
     char option;
-    while ((option = getopt_long(argc, argv, "vqh", long_options, NULL)) > 0) {
+    while ((option = getopt_long(argc, argv, "P:D:r:RuNvqh", long_options,
+                    NULL)) > 0) {
         switch (option) {
+            case 'P':
+                args.protocol_version = strtol(optarg, NULL, 10);
+                if (args.protocol_version < PROTOCOL_V1 ||
+                        args.protocol_version > PROTOCOL_VERSION) {
+                    fprintf(stderr, "Bad protocol version: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                args.motion_rate = strtol(optarg, NULL, 10);
+                if (args.motion_rate < 0) {
+                    fprintf(stderr, "Bad motion rate: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'R':
+#ifdef HAVE_XI2
+                args.raw_input = true;
+#else
+                fprintf(stderr, "Built without XInput2 support\n");
+                exit(EXIT_FAILURE);
+#endif
+                break;
+            case 'u':
+                args.datagrams = true;
+                break;
+            case 'D':
+                args.dscp = strtol(optarg, NULL, 10);
+                if (args.dscp < 0 || args.dscp > DSCP_MAX) {
+                    fprintf(stderr, "Bad DSCP class: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'N':
+                args.low_latency = false;
+                break;
             case 'v':
                 args.verbose = 1;
                 args.quiet = 0;
@@ -414,63 +541,306 @@ static struct args parse_args(int argc, char* argv[]) {
     return args;
 }
 
-static void main_loop(Display* display, int connection, struct args args, struct pointer_info pointer_info) {
+/* Returns the number of milliseconds until gathered motion is due to be sent,
+ * or -1 if there is none.
+ */
+static int motion_timeout(const struct motion* motion, int rate) {
+    if (motion->dx == 0 && motion->dy == 0) {
+        return -1;
+    } else if (rate == 0) {
+        return 0;
+    }
+
+    int64_t remaining_ns = 1000000000LL / rate -
+        (int64_t) elapsed_ns(&motion->last_sent, NULL);
+
+    /* Round up, as sending early would defeat the purpose */
+    return remaining_ns > 0 ? (remaining_ns + 999999) / 1000000 : 0;
+}
+
+static void send_motion(struct sender* sender, struct motion* motion) {
+    if (motion->dx == 0 && motion->dy == 0) {
+        return;
+    }
+
+    forward_motion(sender, motion->dx, motion->dy, motion->captured);
+
+    motion->dx = 0;
+    motion->dy = 0;
+    motion->captured = 0;
+    clock_gettime(CLOCK_MONOTONIC, &motion->last_sent);
+}
+
+static void handle_motion(Display* display, const XMotionEvent* event,
+        uint32_t captured, struct motion* motion,
+        struct point reset_position) {
+    /* Events carry the serial of the last request processed when they were
+     * generated, telling those relative to the reset position apart from
+     * those still relative to where the pointer was before the warp */
+    if (motion->warp_pending &&
+            (long)(event->serial - motion->warp_serial) >= 0) {
+        motion->position = reset_position;
+        motion->warp_pending = false;
+    }
+
+    motion->dx += event->x - motion->position.x;
+    motion->dy += event->y - motion->position.y;
+    if (motion->captured == 0) {
+        motion->captured = captured;
+    }
+    motion->position.x = event->x;
+    motion->position.y = event->y;
+
+    /* Keep the pointer away from the screen edges, with a single warp in
+     * flight at a time */
+    if (!motion->warp_pending && (motion->position.x != reset_position.x ||
+                motion->position.y != reset_position.y)) {
+        motion->warp_serial = NextRequest(display);
+        motion->warp_pending = true;
+        reset_pointer(display, &reset_position);
+    }
+}
+
+#ifdef HAVE_XI2
+static int select_raw_events(Display* display, int* xi_opcode) {
+    int event_base, error_base;
+    if (!XQueryExtension(display, "XInputExtension", xi_opcode, &event_base,
+                &error_base)) {
+        return -1;
+    }
+
+    /* Raw events are delivered during grabs as of version 2.1 */
+    int major = 2, minor = 1;
+    if (XIQueryVersion(display, &major, &minor) != Success ||
+            (major == 2 && minor < 1)) {
+        return -1;
+    }
+
+    unsigned char mask_bits[XIMaskLen(XI_LASTEVENT)] = { 0 };
+    XISetMask(mask_bits, XI_RawMotion);
+    XISetMask(mask_bits, XI_RawButtonPress);
+    XISetMask(mask_bits, XI_RawButtonRelease);
+    XISetMask(mask_bits, XI_RawKeyPress);
+    XISetMask(mask_bits, XI_RawKeyRelease);
+
+    XIEventMask mask = {
+        .deviceid = XIAllMasterDevices,
+        .mask_len = sizeof(mask_bits),
+        .mask = mask_bits
+    };
+
+    return XISelectEvents(display, DefaultRootWindow(display), &mask, 1) ==
+        Success ? 0 : -1;
+}
+
+static void handle_raw_motion(const XIRawEvent* event, uint32_t captured,
+        struct motion* motion) {
+    /* Values are only present for the valuators set in the mask, with the
+     * first two being the X and Y axes */
+    const double* value = event->raw_values;
+    for (int axis = 0; axis < 2 && axis < event->valuators.mask_len * 8;
+            axis++) {
+        if (!XIMaskIsSet(event->valuators.mask, axis)) {
+            continue;
+        }
+
+        if (axis == 0) {
+            motion->remainder_x += *value++;
+        } else {
+            motion->remainder_y += *value++;
+        }
+    }
+
+    /* Sub-pixel motion is carried over until it adds up to whole units */
+    int32_t dx = (int32_t)motion->remainder_x;
+    int32_t dy = (int32_t)motion->remainder_y;
+    motion->remainder_x -= dx;
+    motion->remainder_y -= dy;
+    motion->dx += dx;
+    motion->dy += dy;
+    if (motion->captured == 0 && (dx != 0 || dy != 0)) {
+        motion->captured = captured;
+    }
+}
+
+static unsigned int modifier_mask(const struct keyboard_info* keyboard_info,
+        unsigned int keycode) {
+    const XModifierKeymap* map = keyboard_info->modifier_map;
+    const int modifiers[] = { ShiftMapIndex, ControlMapIndex };
+
+    for (size_t i = 0; i < sizeof(modifiers) / sizeof(modifiers[0]); i++) {
+        for (int j = 0; j < map->max_keypermod; j++) {
+            if (map->modifiermap[modifiers[i] * map->max_keypermod + j] ==
+                    keycode) {
+                return 1 << modifiers[i];
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Forwards a raw XInput2 event, returning true if it was the quit combination.
+ * Raw events carry no modifier state, so the modifiers needed to tell the quit
+ * combination are tracked in modifiers.
+ */
+static bool handle_raw_event(Display* display, const XIRawEvent* raw_event,
+        uint32_t captured, struct sender* sender, struct motion* motion,
+        const struct keyboard_info* keyboard_info, unsigned int* modifiers,
+        uint8_t* pressed_keys, struct args args) {
+    if (raw_event->evtype == XI_RawMotion) {
+        handle_raw_motion(raw_event, captured, motion);
+        return false;
+    }
+
+    /* Turn the raw event into its core counterpart, for forwarding it the
+     * same way */
+    XEvent event = { 0 };
+    switch (raw_event->evtype) {
+        case XI_RawKeyPress:
+            event.type = KeyPress;
+            break;
+        case XI_RawKeyRelease:
+            event.type = KeyRelease;
+            break;
+        case XI_RawButtonPress:
+            event.type = ButtonPress;
+            break;
+        case XI_RawButtonRelease:
+            event.type = ButtonRelease;
+            break;
+        default:
+            return false;
+    }
+
+    if (event.type == KeyPress || event.type == KeyRelease) {
+        event.xkey.keycode = raw_event->detail;
+        event.xkey.state = *modifiers;
+
+        if (event.type == KeyPress) {
+            if (is_quit_combination(keyboard_info, &event.xkey)) {
+                return true;
+            }
+            *modifiers |= modifier_mask(keyboard_info, raw_event->detail);
+        } else {
+            *modifiers &= ~modifier_mask(keyboard_info, raw_event->detail);
+        }
+
+        if (is_key_repeat(pressed_keys, &event.xkey)) {
+            return false;
+        }
+    } else {
+        event.xbutton.button = raw_event->detail;
+    }
+
+    send_motion(sender, motion);
+    forward_key_button_event(display, &event, captured, sender, args);
+
+    return false;
+}
+#endif
+
+static void main_loop(Display* display, struct sender* sender,
+        struct args args, struct pointer_info pointer_info,
+        const struct keyboard_info* keyboard_info, int xi_opcode) {
+    struct motion motion = {
+        .dx = 0,
+        .dy = 0,
+        .remainder_x = 0,
+        .remainder_y = 0,
+        .captured = 0,
+        .position = pointer_info.reset_position,
+        .warp_pending = false
+    };
+    clock_gettime(CLOCK_MONOTONIC, &motion.last_sent);
+
+    struct capture_clock capture_clock = { .anchored = false };
+
+    /* Indexed by X keycode, which is at most 255 */
+    uint8_t pressed_keys[256 / 8] = { 0 };
+
+#ifdef HAVE_XI2
+    unsigned int raw_modifiers = 0;
+#endif
+
     bool quit = false;
     XEvent e;
     while (!quit) {
+        if (motion_timeout(&motion, args.motion_rate) == 0) {
+            send_motion(sender, &motion);
+        }
+
+        if (XPending(display) == 0) {
+            /* Send everything gathered from the X queue before blocking */
+            sender_flush(sender);
+
+            struct pollfd pfds[] = {
+                { .fd = ConnectionNumber(display), .events = POLLIN },
+                { .fd = sender->closed_fd, .events = POLLIN }
+            };
+            if (poll(pfds, 2, motion_timeout(&motion, args.motion_rate)) < 0 &&
+                    errno != EINTR) {
+                perror("poll");
+                break;
+            }
+
+            if (pfds[1].revents) {
+                break;
+            }
+            continue;
+        }
+
         XNextEvent(display, &e);
+
+#ifdef HAVE_XI2
+        if (args.raw_input) {
+            /* Core events are still delivered because of the grabs, but
+             * everything is forwarded from their raw counterparts */
+            XGenericEventCookie* cookie = &e.xcookie;
+            if (cookie->type == GenericEvent &&
+                    cookie->extension == xi_opcode &&
+                    XGetEventData(display, cookie)) {
+                const XIRawEvent* raw_event = cookie->data;
+                quit = handle_raw_event(display, raw_event,
+                        capture_time(&capture_clock, raw_event->time), sender,
+                        &motion, keyboard_info, &raw_modifiers, pressed_keys,
+                        args);
+                XFreeEventData(display, cookie);
+            }
+            continue;
+        }
+#endif
+
         switch (e.type) {
             case KeyPress:
-                if (is_quit_combination(display, (XKeyEvent*)&e)) {
+                if (is_quit_combination(keyboard_info, (XKeyEvent*)&e)) {
                     quit = true;
                     break;
                 }
                 /* fall through */
             case KeyRelease:
-            case ButtonPress:
-            case ButtonRelease:
-                if (consume_autorepeat_event(display, &e)) {
+                if (is_key_repeat(pressed_keys, (XKeyEvent*)&e)) {
                     break;
                 }
-                forward_key_button_event(display, &e, connection, args);
+                /* fall through */
+            case ButtonPress:
+            case ButtonRelease:
+                /* Keep the order of motion and button presses. Key and
+                 * button events are laid out alike up to the time */
+                send_motion(sender, &motion);
+                forward_key_button_event(display, &e,
+                        capture_time(&capture_clock, e.xkey.time), sender,
+                        args);
                 break;
             case MotionNotify:
-                {
-                    XMotionEvent* pointer_event = (XMotionEvent*)&e;
-                    if (pointer_event->x == pointer_info.reset_position.x &&
-                            pointer_event->y == pointer_info.reset_position.y) {
-                        break;
-                    }
-
-                    struct client_event event;
-                    int16_t dx =
-                        pointer_event->x - pointer_info.reset_position.x;
-                    int16_t dy =
-                        pointer_event->y - pointer_info.reset_position.y;
-
-                    if (dx != 0) {
-                        event.type = EV_MOUSE_DX;
-                        event.value = dx;
-                        write_client_event(connection, &event);
-                    }
-
-                    if (dy != 0) {
-                        event.type = EV_MOUSE_DY;
-                        event.value = dy;
-                        write_client_event(connection, &event);
-                    }
-
-                    reset_pointer(display, &pointer_info.reset_position);
-
-                    /* Clear out any events generated by reset_pointer */
-                    while (XCheckTypedEvent(display, MotionNotify, &e));
-                }
+                handle_motion(display, (XMotionEvent*)&e,
+                        capture_time(&capture_clock, e.xmotion.time), &motion,
+                        pointer_info.reset_position);
                 break;
             default:
                 break;
         }
     }
-
 }
 
 int main(int argc, char* argv[]) {
@@ -483,19 +853,66 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    int connection = connect_to_server(args.server_host, args.server_port);
-    if (connection < 0) {
+    /* A closed connection is noticed through poll() and write() instead */
+    signal(SIGPIPE, SIG_IGN);
+
+    struct socket_profile profile = { 0 };
+    if (args.low_latency) {
+        profile = socket_profile_low_latency;
+        profile.dscp = args.dscp;
+    }
+    /* Also notices a server gone away which doesn't take part in heartbeats */
+    profile.peer_timeout = CONNECTION_HEARTBEAT_TIMEOUT_MS;
+
+    static struct connection connection;
+    if (connection_open(&connection, args.server_host, args.server_port,
+                args.datagrams, &profile) < 0) {
         perror("error connecting to server");
         exit(EXIT_FAILURE);
     }
 
+    if (connection_negotiate(&connection, args.protocol_version) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (args.verbose) {
+        printf("Using protocol version %d (capabilities %#x)\n",
+                connection.version, connection.capabilities);
+    }
+
+    /* Have held keys repeat as presses alone, so that repeats can be told
+     * apart and left out */
+    Bool detectable_repeat = False;
+    XkbSetDetectableAutoRepeat(display, True, &detectable_repeat);
+    if (!detectable_repeat && !args.quiet) {
+        fprintf(stderr, "Detectable autorepeat not supported, key repeats "
+                "will be forwarded\n");
+    }
+
+    struct keyboard_info keyboard_info;
+    get_keyboard_info(display, &keyboard_info);
+
     if (lock_keyboard(display) != GrabSuccess) {
         fprintf(stderr, "Couldn't grab keyboard!");
         exit(EXIT_FAILURE);
     }
 
+    uint32_t pointer_event_mask = ButtonPressMask | ButtonReleaseMask;
+    if (!args.raw_input) {
+        pointer_event_mask |= PointerMotionMask;
+    }
+
+    int xi_opcode = -1;
+#ifdef HAVE_XI2
+    if (args.raw_input && select_raw_events(display, &xi_opcode) < 0) {
+        fprintf(stderr, "XInput 2.1 not supported by the X server\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+
     struct pointer_info pointer_info;
-    if (lock_pointer(display, &pointer_info) != GrabSuccess) {
+    if (lock_pointer(display, &pointer_info, pointer_event_mask) !=
+            GrabSuccess) {
         fprintf(stderr, "Couldn't grab pointer!");
         exit(EXIT_FAILURE);
     }
@@ -507,12 +924,29 @@ int main(int argc, char* argv[]) {
                 args.server_host, args.server_port);
     }
 
-    main_loop(display, connection, args, pointer_info);
+    static struct sender sender;
+    if (sender_start(&sender, &connection) < 0) {
+        perror("error starting sender thread");
+        exit(EXIT_FAILURE);
+    }
+
+    main_loop(display, &sender, args, pointer_info, &keyboard_info,
+            xi_opcode);
+
+    sender_stop(&sender);
+
+    if (args.verbose) {
+        printf("Merged %" PRIu64 " motion events, dropped %" PRIu64
+                " stale events, resynchronized keys %" PRIu64 " times\n",
+                connection.stats.merged, connection.stats.dropped,
+                connection.stats.resyncs);
+    }
 
     release_pointer(display, &pointer_info.original_position);
     release_keyboard(display);
+    XFreeModifiermap(keyboard_info.modifier_map);
 
-    close(connection);
+    connection_close(&connection);
 
     if (XCloseDisplay(display)) {
         exit(EXIT_FAILURE);